@@ -0,0 +1,19 @@
+#!/bin/sh
+# Writes a synthetic program of N functions to stdout, for measuring how
+# compile time scales with the size of the source.
+n=${1:-1000}
+
+echo 'struct Pair = { a: Int32, b: Int32 }'
+echo 'def f0(x: Int32): Int32 = x + 1'
+i=1
+while [ $i -lt $n ]; do
+  p=$((i - 1))
+  cat <<SPL
+def f$i(x: Int32): Int32 = {
+  val p = Pair(f$p(x), $i);
+  if (p.a == 0) p.b else p.a * 2 + p.b
+}
+SPL
+  i=$((i + 1))
+done
+echo "io main(): Int32 = { f$((n - 1))(1) }"
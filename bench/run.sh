@@ -0,0 +1,76 @@
+#!/bin/sh
+# Compiles and runs every bench/*.spl workload, plus synthetic sources of
+# growing size, and prints one measurement per line:
+#
+#   <benchmark> <metric> <value>
+#
+# so that the output of two commits can be diffed or joined. Set SPLC,
+# SPLVM, OPT (for splc) and VMOPT (for splvm) to compare builds or
+# optimization levels.
+
+SPLC=${SPLC:-./build/splc}
+SPLVM=${SPLVM:-./build/splvm}
+OPT=${OPT:--O2}
+VMOPT=${VMOPT:-$OPT}
+TMP=${TMPDIR:-/tmp}/spl-bench.$$
+mkdir -p $TMP
+trap 'rm -rf $TMP' EXIT
+
+# Prints `<metric> <value>' lines for wall time and peak RSS of a command.
+measure() {
+  prefix=$1; shift
+  if [ -x /usr/bin/time ]; then
+    /usr/bin/time -f "$prefix-seconds %e
+$prefix-rss-kb %M" -o $TMP/time "$@" > $TMP/out 2>&1 || return 1
+    cat $TMP/time
+  else
+    start=$(date +%s.%N)
+    "$@" > $TMP/out 2>&1 || return 1
+    echo "$prefix-seconds $(awk "BEGIN { print $(date +%s.%N) - $start }")"
+  fi
+}
+
+# Turns the wall times of splc's -time-phases report into
+# `phase-<name>-seconds <value>' lines.
+phases() {
+  awk -F'%\\)' '
+    /SPL compiler phases/ { group = 1; next }
+    /===-/ && group == 1 && seen { group = 0 }
+    group && /%\)/ {
+      seen = 1
+      name = $NF; gsub(/^ +| +$/, "", name)
+      if (name == "Total") next
+      gsub(/ /, "-", name)
+      split($(NF-1), wall, " ")
+      print "phase-" tolower(name) "-seconds " wall[1]
+    }' "$1"
+}
+
+bench() {
+  name=$1
+  src=$2
+  if ! measure compile $SPLC $OPT -time-phases -o $TMP/$name.bc $src \
+      > $TMP/compile; then
+    echo "$name error compile" && cat $TMP/out >&2
+    return
+  fi
+  phases $TMP/out >> $TMP/compile
+  sed "s/^/$name /" $TMP/compile
+
+  [ "$3" = "compile-only" ] && return
+  if ! $SPLVM -time $VMOPT $TMP/$name.bc > $TMP/out 2> $TMP/run; then
+    echo "$name error run" && cat $TMP/out $TMP/run >&2
+    return
+  fi
+  sed -n "s/^Result: /$name result /p" $TMP/out
+  grep -E '^[a-z-]+ [0-9.e+-]+$' $TMP/run | sed "s/^/$name /"
+}
+
+for f in bench/*.spl; do
+  bench $(basename $f .spl) $f
+done
+
+for n in 250 1000 4000; do
+  sh bench/gen-large.sh $n > $TMP/large$n.spl
+  bench large$n $TMP/large$n.spl compile-only
+done
@@ -0,0 +1,75 @@
+#include "arena.h"
+#include <new>
+
+namespace SPL { namespace AST {
+
+Arena *Arena::Current = NULL;
+
+static const size_t SlabSize = 64 * 1024;
+static const size_t Alignment = 16;
+
+// Precedes every ArenaObject, records where it came from.
+struct ObjectHeader {
+  Arena *Owner;
+  unsigned Index;
+  unsigned Pad; // Keeps the object behind it 16 byte aligned.
+};
+
+Arena::Arena(): Cur(NULL), End(NULL), Previous(Current) {
+  Current = this;
+}
+
+Arena::~Arena() {
+  // Objects may refer to each other from their destructors, so run all
+  // destructors before releasing any memory.
+  for (unsigned i=0, e=Objects.size(); i != e; ++i)
+    if (Objects[i] != NULL)
+      Objects[i]->~ArenaObject();
+  for (unsigned i=0, e=Slabs.size(); i != e; ++i)
+    ::operator delete(Slabs[i]);
+  if (Current == this)
+    Current = Previous;
+}
+
+void *Arena::Allocate(size_t size) {
+  size = (size + Alignment - 1) & ~(Alignment - 1);
+  if (size > (size_t)(End - Cur)) {
+    size_t slab = size > SlabSize ? size : SlabSize;
+    Cur = static_cast<char*>(::operator new(slab));
+    End = Cur + slab;
+    Slabs.push_back(Cur);
+  }
+  void *ptr = Cur;
+  Cur += size;
+  return ptr;
+}
+
+unsigned Arena::track(ArenaObject *obj) {
+  Objects.push_back(obj);
+  return Objects.size() - 1;
+}
+
+void *ArenaObject::operator new(size_t size) {
+  Arena *arena = Arena::current();
+  size_t bytes = sizeof(ObjectHeader) + size;
+  ObjectHeader *header = static_cast<ObjectHeader*>(
+    arena ? arena->Allocate(bytes) : ::operator new(bytes));
+  header->Owner = arena;
+  void *obj = header + 1;
+  // The object is constructed at this address, and ArenaObject is its
+  // primary base, so the destructor can be found through it.
+  header->Index = arena ? arena->track(static_cast<ArenaObject*>(obj)) : 0;
+  return obj;
+}
+
+void ArenaObject::operator delete(void *ptr) {
+  if (ptr == NULL)
+    return;
+  ObjectHeader *header = static_cast<ObjectHeader*>(ptr) - 1;
+  if (header->Owner == NULL)
+    ::operator delete(header);
+  else
+    header->Owner->untrack(header->Index);
+}
+
+}};
@@ -0,0 +1,54 @@
+#ifndef SPL_ARENA_H
+#define SPL_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+namespace SPL {
+  namespace AST {
+
+    class ArenaObject;
+
+    // Per-compilation bump allocator. Every ArenaObject created while an
+    // arena is current lives in it, and is destroyed when the arena is.
+    class Arena {
+      std::vector<char*> Slabs;
+      char *Cur, *End;
+      std::vector<ArenaObject*> Objects;
+      Arena *Previous;
+      static Arena *Current;
+
+      Arena(const Arena &);
+      void operator=(const Arena &);
+    public:
+      // Makes the new arena current until it is destroyed.
+      Arena();
+      ~Arena();
+      void *Allocate(size_t size);
+      unsigned track(ArenaObject *obj);
+      void untrack(unsigned idx) { Objects[idx] = NULL; }
+      static Arena *current() { return Current; }
+
+      // Allocations in scope outlive the current arena, for state that is
+      // shared between compilations such as the builtin types.
+      class Suspend {
+        Arena *Saved;
+      public:
+        Suspend(): Saved(Current) { Current = NULL; }
+        ~Suspend() { Current = Saved; }
+      };
+    };
+
+    // Base of AST nodes, STypes and TypePlaceholders. Allocated from the
+    // current arena, or from the heap when there is none.
+    class ArenaObject {
+    public:
+      virtual ~ArenaObject() {}
+      static void *operator new(size_t size);
+      static void operator delete(void *ptr);
+    };
+
+  };
+};
+
+#endif
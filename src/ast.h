@@ -2,6 +2,7 @@
 #include "llvm/Support/IRBuilder.h"
 #include "llvm/Module.h"
 #include "llvm/Support/Debug.h"
+#include "arena.h"
 
 #include <string>
 #include <vector>
@@ -9,6 +10,8 @@
 #include <map>
 #include <sstream>
 
+namespace llvm { class BasicBlock; class FunctionPass; class FunctionPassManager; }
+
 namespace SPL {
   namespace AST {
     using llvm::Module;
@@ -38,14 +41,45 @@ namespace SPL {
     class SArray;
     class TypePlaceholder;
 
-    class TypeInferer {
-      multimap<Expr*, Expr*>  eqns;
-      map<Expr*, SType*>      tys;
-      vector<Member*>         members;
-      vector<ArrayAccess*>    arrayAccesses;
-      unsigned ResolveMembers();
-      unsigned ResolveArrayAccesses();
+    // Worklist of reachable (function, type arguments) pairs. Types are
+    // uniqued, so each specialization is queued exactly once.
+    class Specializations {
+      vector<pair<Func*, vector<SType*> > > Queue;
+      set<pair<Func*, vector<SType*> > > Seen;
     public:
+      void add(Func *fn, const vector<SType*> &bindings) {
+        pair<Func*, vector<SType*> > spec(fn, bindings);
+        if (Seen.insert(spec).second)
+          Queue.push_back(spec);
+      }
+      unsigned size() { return Queue.size(); }
+      pair<Func*, vector<SType*> > &operator[](unsigned i) { return Queue[i]; }
+    };
+
+    class TypeInferer {
+      // Expressions are numbered densely on first use by an inferer, all
+      // inference state lives in flat tables indexed by that number.
+      unsigned Epoch;
+      vector<Expr*>     nodes;
+      vector<SType*>    tys;       // An expression's own type.
+      vector<unsigned>  tyOrder;
+      vector<pair<unsigned, unsigned> > eqns;
+
+      // Equations are solved by union-find, each class shares one type.
+      // Members and array accesses wait on the class of their source.
+      vector<unsigned>  parent;
+      vector<unsigned>  rank;
+      vector<SType*>    classTys;  // Valid at class roots.
+      vector<unsigned>  waiterHead;
+      vector<Expr*>     deferred;
+      vector<unsigned>  waiterNext;
+      unsigned id(Expr *);
+      unsigned find(unsigned);
+      void unite(unsigned, unsigned);
+      void setClassType(unsigned root, SType *, vector<unsigned> &ready);
+      SType *lookup(unsigned);
+    public:
+      TypeInferer();
       void TypeUnification();
       void TypePopulation();
       void eqn(Expr* lhs, Expr* rhs);
@@ -54,23 +88,32 @@ namespace SPL {
       void arrayAccess(ArrayAccess *);
     };
 
-    class Expr {
+    class Expr : public ArenaObject {
+      friend class TypeInferer;
+      unsigned InferId, InferEpoch;
+      unsigned Line, Col; // Where the parser found it, if it recorded that.
     protected:
       SType *ThisType;
-      Expr(): ThisType(NULL) {}
+      Expr();
     public:
+      void setLocation(unsigned line, unsigned col) { Line = line; Col = col; }
+      unsigned getLine() { return Line; }
+      unsigned getCol() { return Col; }
       virtual void Bind(map<string, Expr*> &) = 0;
       virtual Value *Codegen() = 0;
       virtual Expr* LambdaLift(vector<Func*> &newFuncs);
       virtual set<string> *FindFreeVars(set<string> *b);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &) = 0;
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void FindCalls(Specializations &) = 0;
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       virtual void TypeInfer(TypeInferer &) = 0;
       virtual SType *getSType() { return ThisType; }
       virtual void setSType(SType *ty) { ThisType = ty; }
       virtual Type const *getType();
       virtual Value *LValuegen();
       virtual bool isMutable() { return false; }
+      // Flag the calls whose value is the function's return value.
+      virtual void MarkTailCalls() {}
     };
 
     // TODO: more general literal
@@ -80,7 +123,7 @@ namespace SPL {
       Number(int val): Val(val) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       //virtual Type const *getType();
     };
@@ -88,11 +131,11 @@ namespace SPL {
     class StringLiteral: public Expr {
       const std::string Str;
     public:
-      StringLiteral(std::string &s): Str(s) {}
+      StringLiteral(const std::string &s): Str(s) {}
       const std::string &get() { return Str; }
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
     };
 
@@ -103,12 +146,14 @@ namespace SPL {
       Variable(const string &name): Name(name) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       virtual set<string> *FindFreeVars(set<string> *b);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       virtual Value *LValuegen();
       virtual bool isMutable() { return Binding->isMutable(); }
+      Expr *getBinding() { return Binding; }
     };
 
     class UnaryOp : public Expr {
@@ -118,10 +163,11 @@ namespace SPL {
     public:
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
     };
     class Not : public UnaryOp {
     public:
@@ -136,10 +182,11 @@ namespace SPL {
     public:
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       //virtual Type const *getType();
     };
     class Add : public BinaryOp {
@@ -164,6 +211,7 @@ namespace SPL {
       virtual Value *Codegen();
     };
     class JoinString: public BinaryOp {
+      void getPieces(vector<Expr*> &);
     public:
       JoinString(Expr &lhs, Expr &rhs)
         : BinaryOp(lhs, rhs) {}
@@ -176,41 +224,45 @@ namespace SPL {
       Seq(Expr &lhs, Expr &rhs): BinaryOp(lhs, rhs) {}
       virtual void TypeInfer(TypeInferer &);
       virtual Value *Codegen();
+      virtual void MarkTailCalls() { RHS->MarkTailCalls(); }
     };
 
     class Assign : public BinaryOp {
     public:
       Assign(Expr &lhs, Expr &rhs): BinaryOp(lhs, rhs){}
+      virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
       virtual Value *Codegen();
     };
 
     class ArrayAccess : public BinaryOp {
-      SArray *getSourceSType();
     public:
+      SArray *getSourceSType();
       ArrayAccess(Expr &lhs, Expr &rhs): BinaryOp(lhs,rhs) {}
       virtual void TypeInfer(TypeInferer &);
       virtual void TypeInferSecondPass();
       virtual Value *Codegen();
       virtual Value *LValuegen();
       Expr *getSource() { return LHS; }
-      virtual bool isMutable() { return true; }
+      virtual bool isMutable();
     };
 
     class Member : public Expr {
       Expr *Source;
       const string FieldName;
+      bool Assigned; // The left hand side of an assignment.
       SStructType *getSourceSType();
     public:
-      Member(Expr &source, string &fieldName)
-        : Source(&source), FieldName(fieldName) {}
+      Member(Expr &source, const string &fieldName)
+        : Source(&source), FieldName(fieldName), Assigned(false) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual void TypeInferSecondPass();
       virtual Value *Codegen();
       virtual Value *LValuegen();
       Expr *getSource() { return Source; }
+      void setAssigned() { Assigned = true; }
       // TODO: check getSource()->getSType() for qualifier
       virtual bool isMutable() { return true; }
     };
@@ -230,27 +282,32 @@ namespace SPL {
       void setBody(Expr &b) { Body = &b; }
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       virtual bool isMutable() { return CanMutate; }
+      virtual void MarkTailCalls() { Body->MarkTailCalls(); }
       //virtual Type const *getType();
     };
 
     class If : public Expr {
       Expr *Cond, *Then, *Else;
+      bool IsTail; // Both branches return rather than merge.
     public:
       If(Expr& cond, Expr& then, Expr& el)
-        : Cond(&cond), Then(&then), Else(&el) {}
+        : Cond(&cond), Then(&then), Else(&el), IsTail(false) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
+      virtual void MarkTailCalls();
       //virtual Type const *getType();
     };
 
@@ -262,28 +319,65 @@ namespace SPL {
         Cond(&cond), Body(&body) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
     };
 
+    class LoopVar;
+
+    // `for (i <- from until to) body' counts i from `from' up to, but not
+    // including, `to'. `foreach (x <- array) body' binds x to each element.
+    class For : public Expr {
+      string Name;
+      Expr *From, *Until; // Range loops.
+      Expr *Over;         // Foreach loops.
+      Expr *Body;
+      LoopVar *Var;
+      ArrayAccess *Element; // Types the variable of a foreach.
+    public:
+      For(const string &name, Expr &from, Expr &until, Expr &body)
+        : Name(name), From(&from), Until(&until), Over(NULL), Body(&body),
+          Var(NULL), Element(NULL) {}
+      For(const string &name, Expr &over, Expr &body)
+        : Name(name), From(NULL), Until(NULL), Over(&over), Body(&body),
+          Var(NULL), Element(NULL) {}
+      virtual void Bind(map<string, Expr*> &);
+      virtual void TypeInfer(TypeInferer &);
+      virtual void FindCalls(Specializations &);
+      virtual Value *Codegen();
+      virtual set<string> *FindFreeVars(set<string> *b);
+      virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
+    };
+
     class Call : public Expr {
       string CalleeName;
       Expr *Callee; // Either a Closure or a Func. TODO: Subclass Call?
       vector<Expr*> Args;
+      bool IsTail;
+      // Set when lambda lifting makes this a call of the lifted function
+      // from its own body: the variables it captured, passed on first.
+      vector<string> CapturedArgs;
       void getAllArgs(vector<Expr*> &);
+      SFunctionType *getCalleeSType();
+      Func *getGenericFuncArg(unsigned i, vector<SType*> &gens);
 
     public:
       Call(const string &calleeName, const vector<Expr*> &args)
-        : CalleeName(calleeName), Args(args) {}
+        : CalleeName(calleeName), Args(args), IsTail(false) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
       virtual Value *Codegen();
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       Func* getFunc();
+      virtual void MarkTailCalls() { IsTail = true; }
+      Value *ParallelCodegen(vector<Value*> &args);
 
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       void getGenerics(vector<SType*> &);
     };
 
@@ -299,9 +393,22 @@ namespace SPL {
         : Name(name), Source(expr), Alloca(NULL), CanMutate(canMutate) { }
       virtual void Bind(map<string, Expr*> &) {}
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       virtual bool isMutable() { return CanMutate; }
+      Expr *getSource() { return Source; }
+    };
+
+    // The variable of a For, stored to by the loop on every iteration.
+    class LoopVar : public Expr {
+      const string Name;
+      Value *Alloca;
+    public:
+      LoopVar(const string &name): Name(name), Alloca(NULL) {}
+      virtual void Bind(map<string, Expr*> &) {}
+      virtual void TypeInfer(TypeInferer &) {} // Typed by its For.
+      virtual void FindCalls(Specializations &) {}
+      virtual Value *Codegen();
     };
 
     // Used to wrap a local LLVM register for a function argument.
@@ -310,9 +417,10 @@ namespace SPL {
     public:
       RegisterFunArg(SType *ty): Alloca(NULL) { ThisType = ty; }
       void setAlloca(AllocaInst *a) { Alloca = a; }
+      AllocaInst *getAlloca() { return Alloca; }
       virtual void Bind(map<string, Expr*> &) {}
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
     };
 
@@ -333,6 +441,7 @@ namespace SPL {
       Expr* Context; // Only valid prior to lambda lifting.
       Purity Pureness;
       map<vector<SType*>,Function*> functions;
+      llvm::BasicBlock *RecurseBB; // Target of self tail calls during Gen.
 
     vector<AllocaInst*> *createArgAllocas();
 
@@ -341,11 +450,12 @@ namespace SPL {
       Func(const string &name,
           const vector<TypePlaceholder*> &argstys,
           TypePlaceholder &retsty,
-          const vector<TypePlaceholder*> &generics):
+          const vector<TypePlaceholder*> &generics,
+          Purity purity = FunIO):
           Name(name), GenericsAreBound(false),
           RetSTypeName(&retsty), RetSType(NULL),
           Body(NULL), Context(NULL), Generics(generics),
-          Pureness(FunIO) {
+          Pureness(purity), RecurseBB(NULL) {
         for (unsigned i=0, e=argstys.size(); i!=e; ++i){
           Args.push_back("$");
           ArgSTypeNames.push_back(argstys[i]);
@@ -359,7 +469,7 @@ namespace SPL {
           Expr &body, Expr *context, Purity purity):
           Name(name), Body(&body), Context(context),
           RetSTypeName(&retSType), RetSType(NULL),
-          Pureness(purity),
+          Pureness(purity), RecurseBB(NULL),
           Generics(generics), GenericsAreBound(false) {
         for (unsigned i=0, e=args.size(); i != e; ++i) {
           Args.push_back(args[i].first);
@@ -374,24 +484,37 @@ namespace SPL {
           Name(name), Args(args), ArgSTypeNames(argSTypes),
           Body(&body), Context(context),
           RetSTypeName(retSType), RetSType(NULL),
-          Pureness(purity) {}
+          Pureness(purity), RecurseBB(NULL) {}
       const string GetName() { return Name; }
+      Purity getPurity() { return Pureness; }
       void setContext(Expr &context) { Context = &context; }
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Gen();
       virtual Value *Codegen();
       virtual set<string> *FindFreeVars(set<string> *b);
       virtual Expr* LambdaLift(vector<Func*> &newFuncsnewFuncsnewFuncs);
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       SFunctionType *getFunctionSType();
       void getFullName(string &fnName);
       virtual Function *getFunction();
+      // Points the specializations at their namesakes in another module,
+      // dropping the ones it does not have.
+      void remapFunctions(Module *);
+      Function *getClosureCode(unsigned numEnv);
+      llvm::Constant *getClosure();
+      unsigned getNumCaptured();
       vector<string> &getArgNames() { return Args; }
       void getArgRegs(vector<RegisterFunArg*> &args) {
         args.insert(args.end(), ArgRegs.begin(), ArgRegs.end());
       }
+      llvm::BasicBlock *getRecurseBlock() { return RecurseBB; }
+      // For the REPL's wrappers of expressions: the return type is that of
+      // the body, so nothing may call the function before it is inferred.
+      void setReturnInferred() { RetSTypeName = NULL; }
+      void inferReturnType();
       void getGenerics(vector<SType*> &gen);
       bool isGeneric();
       void setGenerics(const vector<SType*> &tys);
@@ -404,8 +527,9 @@ namespace SPL {
           const string &name, 
           const vector<TypePlaceholder*> &generics,
           const vector<TypePlaceholder*> &args,
-          TypePlaceholder &retSType):
-          Func(name, args, retSType, generics) {}
+          TypePlaceholder &retSType,
+          Purity purity = FunIO):
+          Func(name, args, retSType, generics, purity) {}
 
       virtual Function *getFunction();
       virtual Value *Gen() { return getFunction(); }
@@ -422,10 +546,11 @@ namespace SPL {
         FuncName(name), ActivationRecordNames(record), FuncRef(func) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
       //virtual Type const *getType();
-      virtual void RewriteBinding(string &OldName, string &NewName);
+      virtual void RewriteBinding(string &OldName, string &NewName,
+          const vector<string> &Captured);
       Func *getFunc() { return FuncRef; }
       void getArgRegs(vector<RegisterFunArg*> &args);
       vector<Expr*> *getActivationRecord();
@@ -446,7 +571,7 @@ namespace SPL {
         DefaultValue(&defaultVal) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
     };
 
@@ -463,11 +588,11 @@ namespace SPL {
         : STypeName(stName), Params(params), Args(args) {}
       virtual void Bind(map<string, Expr*> &);
       virtual void TypeInfer(TypeInferer &);
-      virtual void FindCalls(vector<pair<Func*,vector<SType*> > > &);
+      virtual void FindCalls(Specializations &);
       virtual Value *Codegen();
     };
 
-    class TypePlaceholder {
+    class TypePlaceholder : public ArenaObject {
       const string Name;
       vector<TypePlaceholder*> Params;
       // TODO: const string TypeClass;
@@ -482,7 +607,7 @@ namespace SPL {
       virtual SGenericType *ResolveAsGeneric(map<string,SType*> &);
     };
 
-    class SType {
+    class SType : public ArenaObject {
       static map<string,SType*> BuiltinsMap;
     protected:
       const string Name;
@@ -492,6 +617,9 @@ namespace SPL {
       virtual void Bind(vector<string> &, map<string, SType*> &) {}
       virtual Type const *getType() = 0;
       virtual Type const *getPassType() { return getType(); }
+      // Whether a value of this type may hold a pointer the collector
+      // has to trace. Allocations of pointer-free objects are atomic.
+      virtual bool containsPointers() { return true; }
       virtual void dump() = 0;
       const string &getName() { return Name; }
       virtual SType *ParamRebind(vector<SType*> &prms) {
@@ -501,31 +629,35 @@ namespace SPL {
       static const map<string,SType*> &Builtins();
     };
 
-    // TODO:  hide all of these classes and use some
-    //        static getters, a la LLVM.
+    // Types are uniqued, a la LLVM: use the static getters rather than
+    // constructing them, so that equal types are the same object and
+    // compare by pointer.
 
     class SVoid : public SType {
     public:
       SVoid(): SType("Void") {}
+      static SVoid *get();
       virtual Type const *getType();
+      virtual bool containsPointers() { return false; }
       virtual void dump();
     };
 
     class SPrimitive : public SType {
     public:
       SPrimitive(const string &name): SType(name) {}
+      virtual bool containsPointers() { return false; }
       virtual void dump();
     };
 
-    class Int8  : public SPrimitive { public:
+    class Int8  : public SPrimitive { public: static Int8 *get();
       Int8(): SPrimitive("Int8") {} virtual Type const *getType(); };
-    class Int16 : public SPrimitive { public:
+    class Int16 : public SPrimitive { public: static Int16 *get();
       Int16(): SPrimitive("Int16") {} virtual Type const *getType(); };
-    class Int32 : public SPrimitive { public:
+    class Int32 : public SPrimitive { public: static Int32 *get();
       Int32(): SPrimitive("Int32") {} virtual Type const *getType(); };
-    class Int64 : public SPrimitive { public:
+    class Int64 : public SPrimitive { public: static Int64 *get();
       Int64(): SPrimitive("Int64") {} virtual Type const *getType(); };
-    class SBool : public SPrimitive { public:
+    class SBool : public SPrimitive { public: static SBool *get();
       SBool(): SPrimitive("Bool") {} virtual Type const *getType(); };
 
     // TODO: common superclass for SStructType and SUnionType.
@@ -536,10 +668,13 @@ namespace SPL {
       vector<TypePlaceholder*> ElementSTypeNames;
       vector<SType*> ElementSTypes;
       Type * ThisType;
+      bool Mutated; // Some field of it is assigned to.
+      bool PassingFixed; // Code has been generated for how it is passed.
     public:
-      SStructType(const string &name): SType(name), ThisType(NULL) {}
+      SStructType(const string &name):
+        SType(name), ThisType(NULL), Mutated(false), PassingFixed(false) {}
       SStructType(const string &name, const vector<pair<string,TypePlaceholder*> > &els)
-          : SType(name), ThisType(NULL) {
+          : SType(name), ThisType(NULL), Mutated(false), PassingFixed(false) {
         for (unsigned i=0, e=els.size(); i != e; ++i) {
           ElementNames.push_back(els[i].first);
           ElementSTypeNames.push_back(els[i].second);
@@ -552,47 +687,52 @@ namespace SPL {
       Type const *getType(int idx) { return ElementSTypes[idx]->getType(); }
       SType *getSType(int idx) { return ElementSTypes[idx]; }
       unsigned getIndex(const string &name);
+      const vector<string> &getElementNames() { return ElementNames; }
       void getElementSTypes(vector<SType*> &argTys) {
         argTys.assign(ElementSTypes.begin(), ElementSTypes.end());
       }
-      bool isUnboxed() { return false; /* TODO */ }
+      void setMutated();
+      // Small structures that are never assigned to behave as values,
+      // so functions take and return them as LLVM aggregates. Only
+      // known once the whole program is type inferred.
+      virtual bool isUnboxed();
+      // Whether the heap object itself holds traceable pointers.
+      virtual bool hasPointerFields();
     };
 
     // As these are general-purpose arrays, their size
     // is not known until runtime. Therefore we must
     // represent them with as an llvm::StructType
-    // containing an llvm::ArrayType with NumElements=0
-    // and an Int32 containing the size.
-    //
-    // TODO:  this struct-with-array double pointer
-    //        is conceptually simple but an unnecessary
-    //        cache hit that can be compiled out by
-    //        either hiding the size in or 'behind' the
-    //        first element. Learn more about LLVM
-    //        before doing this.
+    // containing an Int32 with the size followed by
+    // an llvm::ArrayType with NumElements=0, i.e.
+    // { i32, [0 x T] }*. The size and the elements
+    // share a single allocation, so an element
+    // access is one pointer chase rather than two.
     class SArray : public SStructType {
       static Type *GenericTypeSingleton;
       SType *Contained; // TODO: use SType::Params
     public:
       SArray(SType *ty):
         SStructType("Array"), Contained(ty) {}
+      static SArray *get(SType *ty);
       SType *getContained() { return Contained; }
+      virtual bool hasPointerFields() { return Contained->containsPointers(); }
+      virtual bool isUnboxed() { return false; }
       virtual void Bind(vector<string> &, map<string, SType*> &);
       virtual void dump();
       virtual SType* ParamRebind(vector<SType*> &);
       static Type *GenericType();
     };
 
-    // Stored as { i32, [ 0 x i8]* }*, with the strings
+    // Stored as { i32, [0 x i8] }*, with the strings
     // also NULL-terminated for easy C interop.
     class SString : public SArray {
-      static SString *Singleton;
       vector<string>  ElementNames;
       vector<string>  ElementSTypeNames;
       vector<SType*>  ElementSTypes;
       Type * ThisType;
     public:
-      SString(): SArray(new Int8()) {
+      SString(): SArray(Int8::get()) {
         vector<string> x;
         map<string, SType*> y;
         Bind(x,y);
@@ -608,11 +748,13 @@ namespace SPL {
       SType* Ret;
     public:
       SFunctionType(): SType("Function"), Ret(NULL) {}
-      SFunctionType(string &name, vector<SType*> &args, SType* ret)
+      SFunctionType(const string &name, const vector<SType*> &args, SType* ret)
         : SType(name), Args(args), Ret(ret) {}
+      static SFunctionType *get(const vector<SType*> &args, SType *ret);
       vector<SType*> &getArgs() { return Args; }
       SType* getReturnType() { return Ret; }
       llvm::FunctionType const *getFunctionType();
+      llvm::FunctionType const *getClosureFunctionType();
       virtual Type const *getType();
       virtual void dump();
       virtual SType* ParamRebind(vector<SType*> &);
@@ -643,6 +785,9 @@ namespace SPL {
         id = gid++;
       }
       virtual Type const *getType();
+      virtual bool containsPointers() {
+        return Binding == NULL || Binding->containsPointers();
+      }
       virtual void dump();
       void setBinding(SType *ty) { Binding = ty; }
       SType *getBinding() { return Binding; }
@@ -654,13 +799,29 @@ namespace SPL {
     // TODO: this is really a 'program', as when we
     // do have multiple files, they will all be merged
     // into just one of these classes.
+    // The declarations one input file contributes to a File.
+    struct Source {
+      string Name;
+      vector<Func*> Funcs;
+      vector<Extern*> Externs;
+      vector<SType*> STypes;
+    };
+
+    class CompileCache;
+
     class File {
       string Name;
       vector<Func*> Funcs;
       vector<Extern*> Externs;
       vector<SType*> STypes;
-      void LambdaLiftFuncs();
-      Module FileModule;
+      vector<Source> Sources;
+      void LambdaLiftFuncs(unsigned first);
+      Module *FileModule;
+      // What earlier calls of compile() did, so that the next one only
+      // compiles what has been merged in since.
+      unsigned NumCompiledFuncs, NumCompiledExterns;
+      Specializations Specialized;
+      unsigned NumGenerated;
 
     public:
       File(string &name,
@@ -668,10 +829,63 @@ namespace SPL {
           const vector<Extern*> &externs,
           const vector<SType*> &tys);
       void merge(File &);
-      void compile();
-      void optimize();
-      Module &getModule() { return FileModule; }
-    };
+      // The functions, externs and structures defined at the top level.
+      void getDefinedNames(vector<string> &names);
+      // May be called again after more files are merged in. The new
+      // functions, and the specializations they reach that are not there
+      // yet, are then added to the same module.
+      void compile(CompileCache *cache = NULL);
+      // Runs the -O<level> function passes on `jobs' threads, then the
+      // module passes.
+      void optimize(unsigned level, unsigned jobs = 1);
+      Module &getModule() { return *FileModule; }
+    };
+
+    // Set by -time-phases: File::compile times each phase, and each
+    // function's type inference and code generation, under these groups.
+    extern bool TimePhases;
+    extern const char *const PhaseTimerGroup;
+
+    // Set by -profile-allocs: heap allocations go through the runtime's
+    // spl_alloc_profiled, which counts them by allocation site.
+    extern bool ProfileAllocs;
+
+    // On-disk cache of the code generated for each input file, kept as
+    // `<dir>/<key>.bc'. A file's key hashes its text together with the typed
+    // interfaces (signatures and structure layouts) of the whole program, so
+    // editing a function body only invalidates the file it is in. Generic
+    // functions are never cached: their specializations are generated for
+    // whichever types the rest of the program asks for.
+    class CompileCache {
+      string Dir;
+      map<string,uint64_t> TextHashes;
+      vector<Module*> Hits;
+      vector<pair<const Source*, string> > Misses;
+      string getPath(const Source &, uint64_t programHash);
+    public:
+      CompileCache(const string &dir): Dir(dir) {}
+      // Records an input file's text, before it is parsed.
+      void addText(const string &name, llvm::StringRef text);
+      // Called once types are inferred. Loads the cached code of each
+      // source, adding the functions it defines to `prebuilt'.
+      void lookup(const vector<Source> &, set<Func*> &prebuilt);
+      // Called once code is generated. Stores the code of the sources that
+      // missed, then links in the cached code of those that hit.
+      void update(Module *);
+    };
+
+    // Moves non-escaping GC allocations of structures onto the stack.
+    llvm::FunctionPass *createHeapToStackPass();
+
+    // The per-function optimization pipeline shared by all of File::optimize.
+    void addFunctionPasses(llvm::FunctionPassManager &, unsigned level);
+
+    // Splits the module into `jobs' partitions, runs the function passes over
+    // each in its own context and thread, and links the results back into a
+    // new module in the global context. The given module is left to the
+    // caller to delete.
+    Module *optimizeFunctionsInParallel(
+      Module *, unsigned level, unsigned jobs);
   };
 
   namespace Parser {
@@ -0,0 +1,192 @@
+#include "ast.h"
+
+#include "llvm/LLVMContext.h"
+#include "llvm/PassManager.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <cstdio>
+#include <iostream>
+
+using namespace llvm;
+
+namespace {
+
+// Bump when the code generator changes what it emits for a function.
+const char *CacheVersion = "spl-cache-3";
+
+// FNV-1a, 64 bit.
+uint64_t hashBytes(StringRef s, uint64_t h = 14695981039346656037ULL) {
+  for (unsigned i=0, e=s.size(); i != e; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Every array is named "Array" and every function type is named after
+// those, so spell out what they contain.
+void describeType(SPL::AST::SType *ty, std::string &out) {
+  using namespace SPL::AST;
+  if (ty == NULL) {
+    out.append("?");
+  } else if (SArray *arr = dynamic_cast<SArray*>(ty)) {
+    out.append("Array[");
+    describeType(arr->getContained(), out);
+    out.append("]");
+  } else if (SFunctionType *fty = dynamic_cast<SFunctionType*>(ty)) {
+    const vector<SType*> &args = fty->getArgs();
+    out.append("(");
+    for (unsigned i=0, e=args.size(); i != e; ++i) {
+      if (i != 0)
+        out.append(",");
+      describeType(args[i], out);
+    }
+    out.append(")->");
+    describeType(fty->getReturnType(), out);
+  } else {
+    out.append(ty->getName());
+  }
+}
+
+// What the code of other files can depend on: the structure layouts, how
+// they are passed, and the signatures of the functions and externs.
+void getInterface(const SPL::AST::Source &src, std::string &out) {
+  using namespace SPL::AST;
+  out.append(src.Name).append("\n");
+  for (unsigned i=0, e=src.STypes.size(); i != e; ++i) {
+    out.append("type ").append(src.STypes[i]->getName());
+    if (SStructType *sty = dynamic_cast<SStructType*>(src.STypes[i])) {
+      if (sty->isUnboxed())
+        out.append(" unboxed");
+      const vector<string> &names = sty->getElementNames();
+      vector<SType*> tys;
+      sty->getElementSTypes(tys);
+      for (unsigned j=0, je=tys.size(); j != je; ++j) {
+        out.append(" ").append(names[j]).append(":");
+        describeType(tys[j], out);
+      }
+    }
+    out.append("\n");
+  }
+  for (unsigned i=0, e=src.Externs.size(); i != e; ++i) {
+    out.append("extern ").append(src.Externs[i]->GetName()).append(":");
+    describeType(src.Externs[i]->getFunctionSType(), out);
+    out.append("\n");
+  }
+  for (unsigned i=0, e=src.Funcs.size(); i != e; ++i) {
+    out.append("def ").append(src.Funcs[i]->GetName()).append(":");
+    describeType(src.Funcs[i]->getFunctionSType(), out);
+    out.append("\n");
+  }
+}
+
+} // end anonymous namespace
+
+namespace SPL { namespace AST {
+
+void CompileCache::addText(const string &name, StringRef text) {
+  TextHashes[name] = hashBytes(text);
+}
+
+string CompileCache::getPath(const Source &src, uint64_t programHash) {
+  uint64_t h = hashBytes(CacheVersion);
+  h = hashBytes(ProfileAllocs ? "profile-allocs" : "", h);
+  h = hashBytes(src.Name, h);
+  h = hashBytes(string((const char*)&TextHashes[src.Name], sizeof(uint64_t)), h);
+  h = hashBytes(string((const char*)&programHash, sizeof(uint64_t)), h);
+
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+  return Dir + "/" + key + ".bc";
+}
+
+void CompileCache::lookup(const vector<Source> &sources, set<Func*> &prebuilt) {
+  // Every file is keyed on the interfaces of the whole program, which
+  // is conservative but needs no dependency tracking between files.
+  string interface;
+  for (unsigned i=0, e=sources.size(); i != e; ++i)
+    getInterface(sources[i], interface);
+  uint64_t programHash = hashBytes(interface);
+
+  for (unsigned i=0, e=sources.size(); i != e; ++i) {
+    const Source &src = sources[i];
+    if (TextHashes.count(src.Name) == 0)
+      continue;
+    string path = getPath(src, programHash);
+
+    Module *cached = NULL;
+    if (MemoryBuffer *buf = MemoryBuffer::getFile(path.c_str())) {
+      cached = ParseBitcodeFile(buf, getGlobalContext());
+      delete buf;
+    }
+    if (cached == NULL) {
+      DEBUG(dbgs() << "Cache miss: " << src.Name << "\n");
+      Misses.push_back(std::make_pair(&src, path));
+      continue;
+    }
+
+    DEBUG(dbgs() << "Cache hit: " << src.Name << "\n");
+    Hits.push_back(cached);
+    for (unsigned j=0, je=src.Funcs.size(); j != je; ++j) {
+      Func *fn = src.Funcs[j];
+      if (fn->isGeneric())
+        continue;
+      Function *code = cached->getFunction(fn->GetName());
+      if (code != NULL && !code->isDeclaration())
+        prebuilt.insert(fn);
+    }
+  }
+}
+
+void CompileCache::update(Module *M) {
+  for (unsigned i=0, e=Misses.size(); i != e; ++i) {
+    const Source &src = *Misses[i].first;
+    set<string> owned;
+    for (unsigned j=0, je=src.Funcs.size(); j != je; ++j)
+      if (!src.Funcs[j]->isGeneric())
+        owned.insert(src.Funcs[j]->GetName());
+
+    // Keep the file's own functions, declare everyone else's. Local
+    // helpers (closure wrappers, literals) travel along and are
+    // renamed apart when linked back in.
+    Module *part = CloneModule(M);
+    for (Module::iterator it = part->begin(), e = part->end(); it != e; ++it)
+      if (!it->isDeclaration() && !it->hasLocalLinkage() &&
+          owned.count(it->getName()) == 0)
+        it->deleteBody();
+    PassManager pm;
+    pm.add(createGlobalDCEPass());
+    pm.run(*part);
+
+    string tmp = Misses[i].second + ".tmp", err;
+    {
+      raw_fd_ostream out(tmp.c_str(), err, raw_fd_ostream::F_Binary);
+      if (err.empty())
+        WriteBitcodeToFile(part, out);
+    }
+    delete part;
+    if (!err.empty() || std::rename(tmp.c_str(), Misses[i].second.c_str())) {
+      std::cerr << "Unable to write cache file: " << Misses[i].second
+                << std::endl;
+      std::remove(tmp.c_str());
+    }
+  }
+  Misses.clear();
+
+  for (unsigned i=0, e=Hits.size(); i != e; ++i) {
+    string err;
+    if (Linker::LinkModules(M, Hits[i], &err)) {
+      std::cerr << "Error linking cached code: " << err << std::endl;
+      exit(1);
+    }
+    delete Hits[i];
+  }
+  Hits.clear();
+}
+
+}}
@@ -1,10 +1,14 @@
+#define DEBUG_TYPE "spl"
 #include "ast.h"
+#include "pipeline.h"
 
 #include "llvm/LLVMContext.h"
+#include "llvm/Intrinsics.h"
 #include "llvm/PassManager.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/Verifier.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Transforms/Scalar.h"
-#include "llvm/Support/StandardPasses.h"
 
 #include <iostream>
 #include <map>
@@ -16,6 +20,10 @@ using namespace llvm;
 
 static IRBuilder<> Builder(getGlobalContext());
 
+STATISTIC(NumExprs, "AST expressions created");
+STATISTIC(NumSpecializations, "Function specializations generated");
+STATISTIC(NumInstructions, "IR instructions emitted");
+
 namespace SPL { namespace AST {
 
 // TODO: not globals
@@ -24,10 +32,17 @@ static Module *TheModule;
 // TODO: pass to Bind() along with NamedExprs.
 map<string,SType*> NamedTypes;
 
+// The module's string literal pool.
+static map<string,Constant*> StringLiterals;
+
 
 /////////////////////////////////////////////////////////////////////
 
 
+Expr::Expr(): InferId(0), InferEpoch(0), Line(0), Col(0), ThisType(NULL) {
+  ++NumExprs;
+}
+
 Type const *Expr::getType() { return ThisType->getType(); }
 
 SFunctionType *Func::getFunctionSType() {
@@ -55,6 +70,200 @@ SArray *ArrayAccess::getSourceSType() {
   }
   return sty;
 }
+// Strings are immutable, their literals live in constant memory.
+bool ArrayAccess::isMutable() {
+  return dynamic_cast<SString*>(LHS->getSType()) == NULL;
+}
+
+// Arrays (and Strings) are a single { i32, [0 x T] } allocation. The
+// elements start at the offset of the second field, which accounts for
+// any padding that the element alignment requires after the length.
+static Value *CreateArrayBytes(SArray *sty, Value *length, unsigned extra=0) {
+  const StructType *st = cast<StructType>(sty->getPassType());
+  const Type *i64 = Type::getInt64Ty(getGlobalContext());
+  Value *len = Builder.CreateIntCast(length, i64, true);
+  if (extra != 0)
+    len = Builder.CreateAdd(len, ConstantInt::get(i64, extra));
+  Value *elSize = ConstantExpr::getSizeOf(sty->getContained()->getType());
+  return Builder.CreateAdd(ConstantExpr::getOffsetOf(st, 1),
+    Builder.CreateMul(len, elSize), "arraybytes");
+}
+
+static Value *CreateArrayLengthPtr(Value *array) {
+  return Builder.CreateStructGEP(array, 0, "lenptr");
+}
+
+static Value *CreateArrayElementPtr(Value *array, Value *idx) {
+  const Type *i32 = Type::getInt32Ty(getGlobalContext());
+  Value *idxs[] = {
+    ConstantInt::get(i32, 0), ConstantInt::get(i32, 1), idx };
+  return Builder.CreateInBoundsGEP(array, idxs, idxs + 3, "elptr");
+}
+
+// A loop counting an i32 from begin up to end, skipped when empty. The
+// body is emitted between construction and finish().
+class CountedLoop {
+  BasicBlock *LoopBB, *AfterBB;
+  PHINode *Index;
+  Value *End;
+public:
+  CountedLoop(Value *begin, Value *end, const char *name): End(end) {
+    LLVMContext &ctx = getGlobalContext();
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+    LoopBB = BasicBlock::Create(ctx, name, TheFunction);
+    AfterBB = BasicBlock::Create(ctx, string("after") + name);
+    Builder.CreateCondBr(
+      Builder.CreateICmpSLT(begin, end, "nonempty"), LoopBB, AfterBB);
+    Builder.SetInsertPoint(LoopBB);
+    Index = Builder.CreatePHI(begin->getType(), "i");
+    Index->addIncoming(begin, PreheaderBB);
+  }
+  Value *getIndex() { return Index; }
+  void finish() {
+    Value *NextVar = Builder.CreateNSWAdd(
+      Index, ConstantInt::get(Index->getType(), 1), "nextvar");
+    Index->addIncoming(NextVar, Builder.GetInsertBlock());
+    Builder.CreateCondBr(
+      Builder.CreateICmpSLT(NextVar, End, "loopcond"), LoopBB, AfterBB);
+    Builder.GetInsertBlock()->getParent()->getBasicBlockList().push_back(
+      AfterBB);
+    Builder.SetInsertPoint(AfterBB);
+  }
+};
+
+// A pointer to the first element of an array, typed as its elements.
+static Value *CreateArrayDataPtr(Value *array, SArray *sty) {
+  Value *zero = ConstantInt::get(Type::getInt32Ty(getGlobalContext()), 0);
+  return Builder.CreateBitCast(CreateArrayElementPtr(array, zero),
+    PointerType::getUnqual(sty->getContained()->getType()), "data");
+}
+
+// A NUL terminated C string, as an i8*.
+static Constant *CreateCStringConstant(const string &str, const char *name) {
+  LLVMContext &ctx = getGlobalContext();
+  Constant *init = ConstantArray::get(ctx, str, true);
+  GlobalVariable *glb = new GlobalVariable(*TheModule, init->getType(),
+    true, GlobalValue::PrivateLinkage, init, name);
+  return ConstantExpr::getBitCast(glb, Type::getInt8PtrTy(ctx));
+}
+
+// Objects that cannot hold pointers go through GC_malloc_atomic, so the
+// collector neither scans nor clears them. When profiling, the runtime
+// allocates on behalf of `site', described as `what'.
+static Value *CreateGCMalloc(
+    Value *bytes, bool pointerFree, Expr *site, const string &what) {
+  if (ProfileAllocs) {
+    std::ostringstream name;
+    name << Builder.GetInsertBlock()->getParent()->getName().str() << " "
+         << site->getLine() << ":" << site->getCol() << " " << what;
+    Value *args[] = {
+      bytes,
+      ConstantInt::get(Type::getInt32Ty(getGlobalContext()), pointerFree),
+      CreateCStringConstant(name.str(), "allocsite")
+    };
+    return Builder.CreateCall(
+      TheModule->getFunction("spl_alloc_profiled"), args, args + 3,
+      "gcmalloc");
+  }
+
+  Function *mallocFunc = TheModule->getFunction(
+    pointerFree ? "GC_malloc_atomic" : "GC_malloc");
+  return Builder.CreateCall(mallocFunc, bytes, "gcmalloc");
+}
+
+static void CreateMemSet(Value *dst, Value *byte, Value *size) {
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i8p = Type::getInt8PtrTy(ctx);
+  const Type *tys[] = { i8p, size->getType() };
+  Function *memsetFunc =
+    Intrinsic::getDeclaration(TheModule, Intrinsic::memset, tys, 2);
+  Value *args[] = {
+    Builder.CreateBitCast(dst, i8p), byte, size,
+    ConstantInt::get(Type::getInt32Ty(ctx), 1), ConstantInt::getFalse(ctx) };
+  Builder.CreateCall(memsetFunc, args, args + 5);
+}
+
+static void CreateMemCpy(Value *dst, Value *src, Value *size) {
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i8p = Type::getInt8PtrTy(ctx);
+  const Type *tys[] = { i8p, i8p, size->getType() };
+  Function *memcpyFunc =
+    Intrinsic::getDeclaration(TheModule, Intrinsic::memcpy, tys, 3);
+  Value *args[] = {
+    Builder.CreateBitCast(dst, i8p), Builder.CreateBitCast(src, i8p), size,
+    ConstantInt::get(Type::getInt32Ty(ctx), 1), ConstantInt::getFalse(ctx) };
+  Builder.CreateCall(memcpyFunc, args, args + 5);
+}
+
+// Unboxed structures cross function boundaries as LLVM aggregates. In
+// between they are kept in stack slots of the function using them, so
+// that the rest of the code only ever sees pointers to structures, and
+// SROA breaks the slots up into registers.
+static SStructType *getUnboxedSType(SType *ty) {
+  if (SGenericType *gen = dynamic_cast<SGenericType*>(ty))
+    ty = gen->getBinding();
+  SStructType *sty = dynamic_cast<SStructType*>(ty);
+  return sty != NULL && sty->isUnboxed() ? sty : NULL;
+}
+
+static const Type *getDirectType(SType *ty) {
+  if (SStructType *sty = getUnboxedSType(ty))
+    return sty->getPassType();
+  return ty->getType();
+}
+
+// The signature of the code of a function defined in SPL.
+static const FunctionType *getDirectFunctionType(SFunctionType *fty) {
+  vector<const Type*> args;
+  vector<SType*> &argSTys = fty->getArgs();
+  for (unsigned i=0, e=argSTys.size(); i != e; ++i)
+    args.push_back(getDirectType(argSTys[i]));
+  return FunctionType::get(
+    getDirectType(fty->getReturnType()), args, false);
+}
+
+static Value *CreateBox(Value *val, SStructType *sty, Expr *site) {
+  Value *box = Builder.CreateBitCast(
+    CreateGCMalloc(ConstantExpr::getSizeOf(sty->getPassType()),
+      !sty->hasPointerFields(), site, sty->getName()),
+    PointerType::getUnqual(sty->getPassType()), "box");
+  Builder.CreateStore(val, box);
+  return box;
+}
+
+// A slot in the entry block, where SROA and mem2reg can promote it.
+static AllocaInst *CreateStackSlot(const Type *ty, const string &name) {
+  Function *fn = Builder.GetInsertBlock()->getParent();
+  IRBuilder<> TmpB(&fn->getEntryBlock(), fn->getEntryBlock().begin());
+  return TmpB.CreateAlloca(ty, 0, name.c_str());
+}
+
+static Value *CreateUnboxed(Value *val, const string &name) {
+  Value *slot = CreateStackSlot(val->getType(), name);
+  Builder.CreateStore(val, slot);
+  return slot;
+}
+
+// The slot of an unboxed structure is reused by the next call, or the
+// next evaluation of the same expression, so a value stored anywhere but
+// into a local, or passed to C, is boxed on the heap first.
+static Value *CreateEscapingValue(Value *val, SType *ty, Expr *site) {
+  if (SStructType *sty = getUnboxedSType(ty))
+    return Builder.CreateBitCast(
+      CreateBox(Builder.CreateLoad(val, "unbox"), sty, site), val->getType());
+  return val;
+}
+
+// Returns val from the current function, unboxing it if need be.
+static void CreateReturn(Value *val) {
+  const Type *retTy = Builder.GetInsertBlock()->getParent()->getReturnType();
+  if (isa<StructType>(retTy))
+    val = Builder.CreateLoad(
+      Builder.CreateBitCast(val, PointerType::getUnqual(retTy)), "unbox");
+  Builder.CreateRet(val);
+}
+
 
 /////////////////////////////////////////////////////////////////////
 
@@ -79,6 +288,34 @@ void BinaryOp::Bind(map<string, Expr*> &NamedExprs) {
   RHS->Bind(NamedExprs);
 }
 
+// The function whose body is being bound, for checking its purity.
+static Func *BindingFunc = NULL;
+
+static const char *getPurityName(Purity purity) {
+  switch (purity) {
+  case Pure: return "def";
+  case Impure: return "imp";
+  default: return "io";
+  }
+}
+
+void Assign::Bind(map<string, Expr*> &NamedExprs) {
+  BinaryOp::Bind(NamedExprs);
+  // Its structure is mutable, see SStructType::isUnboxed.
+  if (Member *member = dynamic_cast<Member*>(LHS))
+    member->setAssigned();
+
+  // Local variables belong to the call, anything else is visible to the
+  // caller.
+  if (BindingFunc != NULL && BindingFunc->getPurity() == Pure &&
+      (dynamic_cast<ArrayAccess*>(LHS) || dynamic_cast<Member*>(LHS))) {
+    std::cerr << "def `" << BindingFunc->GetName()
+              << "' cannot assign to arrays or structures, make it imp"
+              << std::endl;
+    exit(1);
+  }
+}
+
 void Member::Bind(map<string, Expr*> &NamedExprs) {
   Source->Bind(NamedExprs);
 }
@@ -138,10 +375,113 @@ void While::Bind(map<string, Expr*> &NamedExprs) {
   Body->Bind(NamedExprs);
 }
 
+void For::Bind(map<string, Expr*> &NamedExprs) {
+  if (Over == NULL) {
+    From->Bind(NamedExprs);
+    Until->Bind(NamedExprs);
+  } else {
+    Over->Bind(NamedExprs);
+  }
+
+  Expr *OldExpr = NamedExprs[Name];
+  Var = new LoopVar(Name);
+  NamedExprs[Name] = Var;
+  Body->Bind(NamedExprs);
+  NamedExprs[Name] = OldExpr;
+
+  if (Over != NULL)
+    Element = new ArrayAccess(*Over, *new Number(0));
+}
+
+// Looks through immutable bindings of a function or closure, so that
+// calls through them can be made directly.
+static Expr *ResolveCallee(Expr *callee) {
+  while (Register *reg = dynamic_cast<Register*>(callee)) {
+    if (reg->isMutable())
+      break;
+    Expr *src = reg->getSource();
+    if (Variable *var = dynamic_cast<Variable*>(src))
+      src = var->getBinding();
+    if (dynamic_cast<Closure*>(src) == NULL && dynamic_cast<Func*>(src) == NULL
+        && dynamic_cast<Register*>(src) == NULL)
+      break;
+    callee = src;
+  }
+  return callee;
+}
+
+// The effects a function value may have when called: those of the
+// function it is known to be, or, for a function typed parameter of the
+// function being bound, its own, which its callers have checked against.
+static bool getFunctionValuePurity(Expr *val, Purity &purity, string &name) {
+  if (Variable *var = dynamic_cast<Variable*>(val))
+    val = var->getBinding();
+  val = ResolveCallee(val);
+  if (Closure *cl = dynamic_cast<Closure*>(val))
+    val = cl->getFunc();
+  if (Func *fn = dynamic_cast<Func*>(val)) {
+    purity = fn->getPurity();
+    name = fn->GetName();
+    return true;
+  }
+  if (dynamic_cast<RegisterFunArg*>(val) != NULL && BindingFunc != NULL &&
+      dynamic_cast<SFunctionType*>(val->getSType()) != NULL) {
+    purity = BindingFunc->getPurity();
+    name = BindingFunc->GetName() + "'s argument";
+    return true;
+  }
+  return false;
+}
+
 void Closure::Bind(map<string,Expr*> &NamedExprs) {
   vector<string>::const_iterator it;
-  for (it=ActivationRecordNames.begin(); it!=ActivationRecordNames.end(); ++it)
-    ActivationRecord.push_back(NamedExprs[*it]);
+  for (it=ActivationRecordNames.begin(); it!=ActivationRecordNames.end(); ++it) {
+    Expr *captured = NamedExprs[*it];
+    if (captured == NULL) {
+      std::cerr << "Failed to bind captured variable " << *it << std::endl;
+      exit(1);
+    }
+    ActivationRecord.push_back(captured);
+
+    // What the closure calls is part of what it does.
+    Purity purity;
+    string name;
+    if (getFunctionValuePurity(captured, purity, name) &&
+        purity > FuncRef->getPurity()) {
+      std::cerr << getPurityName(FuncRef->getPurity()) << " `"
+                << FuncRef->GetName() << "' cannot capture "
+                << getPurityName(purity) << " function `" << name << "'"
+                << std::endl;
+      exit(1);
+    }
+  }
+}
+
+// The data parallel primitives declared by the prelude. Their loops are
+// generated at the call, ParallelCodegen, and run by spl_par_run.
+enum ParallelOp { ParMap, ParFor, ParReduce };
+
+struct ParallelPrimitive {
+  const char *Name;
+  ParallelOp Op;
+  unsigned FuncArg;     // The argument run on every element.
+  Purity MostEffects;   // What that function may do.
+};
+
+static const ParallelPrimitive ParallelPrimitives[] = {
+  { "parMap", ParMap, 1, Pure },
+  { "parFor", ParFor, 1, Impure }, // Pure bodies would have no effect.
+  { "parReduce", ParReduce, 2, Pure },
+};
+
+static const ParallelPrimitive *getParallelPrimitive(Func *fn) {
+  if (dynamic_cast<Extern*>(fn) == NULL)
+    return NULL;
+  unsigned n = sizeof(ParallelPrimitives) / sizeof(ParallelPrimitives[0]);
+  for (unsigned i=0; i != n; ++i)
+    if (fn->GetName() == ParallelPrimitives[i].Name)
+      return &ParallelPrimitives[i];
+  return NULL;
 }
 
 void Call::Bind(map<string, Expr*> &NamedExprs) {
@@ -151,9 +491,78 @@ void Call::Bind(map<string, Expr*> &NamedExprs) {
     std::cerr << "Cannot find function `" << CalleeName << "'" << std::endl;
     exit(1);
   }
+  Callee = ResolveCallee(Callee);
 
   for (unsigned i=0, e=Args.size(); i != e; ++i)
     Args[i]->Bind(NamedExprs);
+
+  // A lifted function calling itself passes on its captured variables.
+  // They are its leading arguments, whatever else in its body shadows them.
+  if (!CapturedArgs.empty()) {
+    Func *fn = dynamic_cast<Func*>(Callee);
+    assert(fn == BindingFunc && fn->getNumCaptured() == CapturedArgs.size());
+    vector<RegisterFunArg*> argRegs;
+    fn->getArgRegs(argRegs);
+    for (unsigned i=CapturedArgs.size(); i-- > 0; ) {
+      map<string, Expr*> capture;
+      capture[CapturedArgs[i]] = argRegs[i];
+      Variable *var = new Variable(CapturedArgs[i]);
+      var->Bind(capture);
+      Args.insert(Args.begin(), var);
+    }
+    CapturedArgs.clear();
+  }
+
+  // A function may only call functions with at most its own effects.
+  // Calls through function values are not known until run time.
+  Func *callee = getFunc();
+  if (callee != NULL && BindingFunc != NULL &&
+      callee->getPurity() > BindingFunc->getPurity()) {
+    std::cerr << getPurityName(BindingFunc->getPurity()) << " `"
+              << BindingFunc->GetName() << "' cannot call "
+              << getPurityName(callee->getPurity()) << " function `"
+              << callee->GetName() << "'" << std::endl;
+    exit(1);
+  }
+
+  // Nor may it be passed functions with more, which it could call. That
+  // is what makes calls through function parameters safe.
+  if (callee != NULL || BindingFunc != NULL) {
+    Purity most = callee != NULL ? callee->getPurity()
+                                 : BindingFunc->getPurity();
+    for (unsigned i=0, e=Args.size(); i != e; ++i) {
+      Purity purity;
+      string name;
+      if (getFunctionValuePurity(Args[i], purity, name) && purity > most) {
+        std::cerr << getPurityName(most) << " `" << CalleeName
+                  << "' cannot be passed " << getPurityName(purity)
+                  << " function `" << name << "'" << std::endl;
+        exit(1);
+      }
+    }
+  }
+
+  // The parallel primitives run their function on several threads at
+  // once, so it has to be one known not to interfere with itself.
+  if (const ParallelPrimitive *par = getParallelPrimitive(getFunc())) {
+    Expr *arg = Args[par->FuncArg];
+    if (Variable *var = dynamic_cast<Variable*>(arg))
+      arg = ResolveCallee(var->getBinding());
+    if (Closure *cl = dynamic_cast<Closure*>(arg))
+      arg = cl->getFunc();
+    Func *fn = dynamic_cast<Func*>(arg);
+    if (fn == NULL || dynamic_cast<Extern*>(fn) != NULL) {
+      std::cerr << CalleeName << " needs a function defined in SPL"
+                << std::endl;
+      exit(1);
+    }
+    if (fn->getPurity() > par->MostEffects) {
+      std::cerr << CalleeName << " needs a "
+                << (par->MostEffects == Pure ? "pure (def)" : "def or imp")
+                << " function, `" << fn->GetName() << "' is not" << std::endl;
+      exit(1);
+    }
+  }
 }
 
 void Func::Bind(map<string, Expr*> &NamedExprs) {
@@ -171,14 +580,21 @@ void Func::Bind(map<string, Expr*> &NamedExprs) {
     NamedTypes[ty->getName()] = ty;
   }
 
-  RetSType = RetSTypeName->Resolve(NamedTypes);
-  if (RetSType == NULL) {
-    std::cerr << "Unknown return type `" << RetSTypeName->getName() <<
-      "' on function `" << Name << "'." << std::endl;
-    exit(1);
+  if (RetSTypeName != NULL) {
+    RetSType = RetSTypeName->Resolve(NamedTypes);
+    if (RetSType == NULL) {
+      std::cerr << "Unknown return type `" << RetSTypeName->getName() <<
+        "' on function `" << Name << "'." << std::endl;
+      exit(1);
+    }
   }
 
   for (unsigned i=0, e=Args.size(); i != e; ++i) {
+    if (ArgSTypeNames[i] == NULL) {
+      // Captured by a lifted function, typed during type inference.
+      ArgSTypes.push_back(NULL);
+      continue;
+    }
     SType *ty = ArgSTypeNames[i]->Resolve(NamedTypes);
     if (ty == NULL) {
       std::cerr << "Unknown argument type `" << ArgSTypeNames[i] <<
@@ -191,7 +607,8 @@ void Func::Bind(map<string, Expr*> &NamedExprs) {
   for (unsigned i=0, e=Generics.size(); i != e; ++i)
     NamedTypes[Generics[i]->getName()] = NULL;
 
-  setSType(new SFunctionType(Name, ArgSTypes, RetSType));
+  if (RetSType != NULL)
+    setSType(SFunctionType::get(ArgSTypes, RetSType));
 
   // Bind body.
   vector<Expr*> oldBindings;
@@ -203,8 +620,11 @@ void Func::Bind(map<string, Expr*> &NamedExprs) {
     NamedExprs[Args[i]] = reg;
   }
 
+  Func *oldBindingFunc = BindingFunc;
+  BindingFunc = this;
   if (Body)
     Body->Bind(NamedExprs);
+  BindingFunc = oldBindingFunc;
 
   for (unsigned i=0, e=Args.size(); i != e; ++i)
     NamedExprs[Args[i]] = oldBindings[i];
@@ -217,49 +637,74 @@ void Func::Bind(map<string, Expr*> &NamedExprs) {
 /////////////////////////////////////////////////////////////////////
 
 
-void Number::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) { }
-void StringLiteral::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) { }
-void Variable::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) { }
-void UnaryOp::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Number::FindCalls(Specializations &calls) { }
+void StringLiteral::FindCalls(Specializations &calls) { }
+// Functions used as values are reachable. A generic one is specialized
+// only once its bindings are known, as when it is a call's argument.
+void Variable::FindCalls(Specializations &calls) {
+  Func *fn = dynamic_cast<Func*>(Binding);
+  if (fn != NULL && dynamic_cast<Extern*>(fn) == NULL) {
+    vector<SType*> genericBindings;
+    fn->getGenerics(genericBindings);
+    if (fn->isGeneric() && Util::allNull(genericBindings))
+      return;
+    calls.add(fn, genericBindings);
+  }
+}
+void UnaryOp::FindCalls(Specializations &calls) {
   SubExpr->FindCalls(calls);
 }
-void BinaryOp::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void BinaryOp::FindCalls(Specializations &calls) {
   LHS->FindCalls(calls);
   RHS->FindCalls(calls);
 }
-void Member::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Member::FindCalls(Specializations &calls) {
   Source->FindCalls(calls);
 }
-void Binding::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Binding::FindCalls(Specializations &calls) {
   Init->FindCalls(calls);
   Body->FindCalls(calls);
 }
-void If::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void If::FindCalls(Specializations &calls) {
   Cond->FindCalls(calls);
   Then->FindCalls(calls);
   Else->FindCalls(calls);
 }
-void While::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void While::FindCalls(Specializations &calls) {
   Cond->FindCalls(calls);
   Body->FindCalls(calls);
 }
-void Call::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
-  for (unsigned i=0, e=Args.size(); i != e; ++i)
-    Args[i]->FindCalls(calls);
+void For::FindCalls(Specializations &calls) {
+  if (Over == NULL) {
+    From->FindCalls(calls);
+    Until->FindCalls(calls);
+  } else {
+    Over->FindCalls(calls);
+  }
+  Body->FindCalls(calls);
+}
+void Call::FindCalls(Specializations &calls) {
+  for (unsigned i=0, e=Args.size(); i != e; ++i) {
+    // Generic functions passed as values need their specialization too.
+    vector<SType*> argBindings;
+    Func *argFn = getGenericFuncArg(i, argBindings);
+    if (argFn == NULL)
+      Args[i]->FindCalls(calls);
+    else if (dynamic_cast<Extern*>(argFn) == NULL)
+      calls.add(argFn, argBindings);
+  }
 
-  vector<SType*> genericBindings;
   Func *fn = getFunc();
   if (fn == NULL)
     return;
+  if (Closure *cl = dynamic_cast<Closure*>(Callee))
+    cl->FindCalls(calls);
   if (dynamic_cast<Extern*>(fn))
     return;
+  vector<SType*> genericBindings;
   getGenerics(genericBindings);
-  pair<Func*, vector<SType*> > res(fn, genericBindings);
+  calls.add(fn, genericBindings);
 
-  if (Util::contains(calls, res))
-    return;
-
-  calls.push_back(res);
   vector<SType*> oldGenericBindings;
   fn->getGenerics(oldGenericBindings);
   fn->setGenerics(genericBindings);
@@ -272,26 +717,27 @@ void Call::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
       setSType(boundRet);
     }
   }
-  fn->FindCalls(calls);
   fn->setGenerics(oldGenericBindings);
 }
-void Func::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Func::FindCalls(Specializations &calls) {
   if (Body)
     Body->FindCalls(calls);
 }
-void Closure::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
-  // TODO: what about the ActivationRecord?
+void Closure::FindCalls(Specializations &calls) {
+  calls.add(FuncRef, vector<SType*>());
+  for (unsigned i=0, e=ActivationRecord.size(); i != e; ++i)
+    ActivationRecord[i]->FindCalls(calls);
 }
-void Array::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Array::FindCalls(Specializations &calls) {
   SizeExpr->FindCalls(calls);
   DefaultValue->FindCalls(calls);
 }
-void Constructor::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {
+void Constructor::FindCalls(Specializations &calls) {
   for (unsigned i=0, e=Args.size(); i != e; ++i)
     Args[i]->FindCalls(calls);
 }
-void Register::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {}
-void RegisterFunArg::FindCalls(vector<pair<Func*,vector<SType*> > > &calls) {}
+void Register::FindCalls(Specializations &calls) {}
+void RegisterFunArg::FindCalls(Specializations &calls) {}
 
 
 /////////////////////////////////////////////////////////////////////
@@ -313,11 +759,8 @@ Value *Variable::LValuegen() {
 Value *ArrayAccess::LValuegen() {
   const Type *Contained = getSourceSType()->getContained()->getType();
   Value *src = LHS->Codegen();
-  Value *array = Builder.CreateLoad(Builder.CreateStructGEP(src, 1));
-  Value *castVal =
-    Builder.CreateBitCast(array, PointerType::getUnqual(Contained));
-  Value *val = Builder.CreateGEP(castVal, RHS->Codegen());
-  return val;
+  Value *val = CreateArrayElementPtr(src, RHS->Codegen());
+  return Builder.CreateBitCast(val, PointerType::getUnqual(Contained));
 }
 
 Value *Member::LValuegen() {
@@ -333,7 +776,16 @@ Value *Number::Codegen() {
   return ConstantInt::get(getGlobalContext(), APInt(32, Val, true));
 }
 
+// Registers evaluate to their slot, functions to their closure.
+static Value *CreateLoadBinding(Expr *binding, const string &name) {
+  if (Func *fn = dynamic_cast<Func*>(binding))
+    return fn->getClosure();
+  return Builder.CreateLoad(binding->Codegen(), name.c_str());
+}
+
 Value *Variable::Codegen() {
+  if (dynamic_cast<Func*>(Binding))
+    return CreateLoadBinding(Binding, Name);
   return Builder.CreateLoad(LValuegen(), Name.c_str());
 }
 
@@ -357,38 +809,71 @@ Value *Eq::Codegen() {
 }
 
 Value *StringLiteral::Codegen() {
+  // Literals are interned as constant %string globals, one per distinct
+  // text in the module, so evaluating one never allocates.
+  Constant *&lit = StringLiterals[Str];
+  if (lit == NULL) {
+    LLVMContext &ctx = getGlobalContext();
+    vector<Constant*> fields;
+    fields.push_back(ConstantInt::get(Type::getInt32Ty(ctx), Str.length()));
+    fields.push_back(ConstantArray::get(ctx, Str, true));
+    Constant *init = ConstantStruct::get(ctx, fields, false);
+    GlobalVariable *glb = new GlobalVariable(*TheModule, init->getType(),
+      true, GlobalValue::PrivateLinkage, init, "str");
+    lit = ConstantExpr::getBitCast(glb, SString::get()->getType());
+  }
+  return lit;
+}
 
-  // Heap allocate the structure containing the size.
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
-  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-    TheFunction->getEntryBlock().begin());
-
-  // TODO: are we repeating ourselves here when the same string is repeated?
-  Value *glb = Builder.CreateGlobalString(Str.c_str());
-  glb = TmpB.CreateBitCast(glb, PointerType::getUnqual(
-        ArrayType::get(Type::getInt8Ty(getGlobalContext()), 0)));
-
-  Function *mallocFunc = TheModule->getFunction("GC_malloc");
-  Type const *ty = ThisType->getPassType();
-  Value *mallocArg = ConstantExpr::getSizeOf(ty);
-
-  Value *val = TmpB.CreateCall(mallocFunc, mallocArg);
-  Value *castVal = TmpB.CreateBitCast(val, PointerType::getUnqual(ty));
-
-  Value *sizeGep = TmpB.CreateStructGEP(castVal, 0);
-  ConstantInt *size =
-    ConstantInt::getSigned(Type::getInt32Ty(getGlobalContext()), Str.length());
-  Builder.CreateStore(size, sizeGep);
-
-  Value *ptrGep = TmpB.CreateStructGEP(castVal, 1);
-  Builder.CreateStore(glb, ptrGep);
-
-  return castVal;
+// `a ++ b ++ c' parses as nested JoinStrings, collect the strings being
+// joined so that the whole chain is built with a single allocation.
+void JoinString::getPieces(vector<Expr*> &pieces) {
+  if (JoinString *lhs = dynamic_cast<JoinString*>(LHS))
+    lhs->getPieces(pieces);
+  else
+    pieces.push_back(LHS);
+  if (JoinString *rhs = dynamic_cast<JoinString*>(RHS))
+    rhs->getPieces(pieces);
+  else
+    pieces.push_back(RHS);
 }
 
 Value *JoinString::Codegen() {
-  // TODO: malloc a new string
-  return NULL;
+  vector<Expr*> pieces;
+  getPieces(pieces);
+
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i32 = Type::getInt32Ty(ctx);
+  Value *zero = ConstantInt::get(i32, 0);
+
+  vector<Value*> strs;
+  vector<Value*> lens;
+  Value *total = zero;
+  for (unsigned i=0, e=pieces.size(); i != e; ++i) {
+    Value *str = pieces[i]->Codegen();
+    Value *len = Builder.CreateLoad(CreateArrayLengthPtr(str), "len");
+    strs.push_back(str);
+    lens.push_back(len);
+    total = Builder.CreateAdd(total, len, "joinlen");
+  }
+
+  SArray *sty = SString::get();
+  Value *val =
+    CreateGCMalloc(CreateArrayBytes(sty, total, 1), true, this, "String ++");
+  Value *joined = Builder.CreateBitCast(val, sty->getType());
+  Builder.CreateStore(total, CreateArrayLengthPtr(joined));
+
+  Value *offset = zero;
+  for (unsigned i=0, e=strs.size(); i != e; ++i) {
+    CreateMemCpy(CreateArrayElementPtr(joined, offset),
+      CreateArrayElementPtr(strs[i], zero),
+      Builder.CreateIntCast(lens[i], Type::getInt64Ty(ctx), false));
+    offset = Builder.CreateAdd(offset, lens[i]);
+  }
+  Builder.CreateStore(ConstantInt::get(Type::getInt8Ty(ctx), 0),
+    CreateArrayElementPtr(joined, offset));
+
+  return joined;
 }
 
 Value *Seq::Codegen() {
@@ -402,7 +887,7 @@ Value *Assign::Codegen() {
     std::cerr << "Attempting assignment to immutable value." << std::endl;
     exit(1);
   }
-  Value *Val = RHS->Codegen();
+  Value *Val = CreateEscapingValue(RHS->Codegen(), RHS->getSType(), this);
   Builder.CreateStore(Val, LVal);
   return Val;
 }
@@ -415,102 +900,104 @@ Value *Member::Codegen() {
   return Builder.CreateLoad(LValuegen());
 }
 
+// Whether every byte of the constant c is the same, and if so which.
+static bool isByteSplat(Constant *c, uint64_t &byte) {
+  ConstantInt *ci = dyn_cast<ConstantInt>(c);
+  if (ci == NULL || ci->getBitWidth() % 8 != 0)
+    return false;
+  const APInt &val = ci->getValue();
+  byte = val.getLoBits(8).getZExtValue();
+  for (unsigned i=8, e=val.getBitWidth(); i < e; i += 8)
+    if (val.lshr(i).getLoBits(8).getZExtValue() != byte)
+      return false;
+  return true;
+}
+
 Value *Array::Codegen() {
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i64 = Type::getInt64Ty(ctx);
   Value *arraySize = SizeExpr->Codegen();
 
-  // Heap allocation.
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
-  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-    TheFunction->getEntryBlock().begin());
-
-  Type const *ty = ThisType->getPassType();
-  Function *mallocFunc = TheModule->getFunction("GC_malloc");
-  Value *mallocArg = ConstantExpr::getSizeOf(ty);
-
-  Value *val = TmpB.CreateCall(mallocFunc, mallocArg);
-  Value *castVal = TmpB.CreateBitCast(val, PointerType::getUnqual(ty));
-
-  Value *sizePtr = TmpB.CreateStructGEP(castVal, 0);
-  Builder.CreateStore(arraySize, sizePtr);
-  arraySize = TmpB.CreateIntCast(arraySize,
-      Type::getInt64Ty(getGlobalContext()), true);
+  // Heap allocation of the size and elements together. This has to
+  // happen where the expression is evaluated, as the size is dynamic.
+  SArray *sty = dynamic_cast<SArray*>(ThisType);
+  Type const *ty = sty->getPassType();
+  bool pointerFree = !sty->hasPointerFields();
+  Value *val = CreateGCMalloc(
+    CreateArrayBytes(sty, arraySize), pointerFree, this, sty->getName());
+  Value *castVal = Builder.CreateBitCast(val, PointerType::getUnqual(ty));
 
-  const Type *contained = Contained->getType();
-  Value *sizeofC = ConstantExpr::getSizeOf(contained);
-  Value *arrayBytes = TmpB.CreateMul(arraySize, sizeofC);
-  Value *arrVal = TmpB.CreateCall(mallocFunc, arrayBytes);
-  arrVal = TmpB.CreateBitCast(arrVal, PointerType::getUnqual(
-        ArrayType::get(contained, 0)));
+  Builder.CreateStore(arraySize, CreateArrayLengthPtr(castVal));
+  arraySize = Builder.CreateIntCast(arraySize, i64, true);
 
   // Set initial values.
-  {
-    // TODO:  This is a repeat of the code in While::Codegen(). Instead,
-    //        let's just create an AST fragment for this that uses While,
-    //        and Codegen() it here.
-    if (DefaultValue == 0)
-      std::cout << "unexpected null default value." << std::endl;
-    Value *defaultVal = DefaultValue->Codegen();
-    Value *StartVal = ConstantInt::get(getGlobalContext(), APInt(64, 0, true));
-
-    // Make the new basic block for the loop header, inserting after current block.
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
-    BasicBlock *PreheaderBB = Builder.GetInsertBlock();
-    BasicBlock *LoopBB = BasicBlock::Create(getGlobalContext(), "loop", TheFunction);
-    // Insert an explicit fall through from the current block to the LoopBB.
-    Builder.CreateBr(LoopBB);
-    // Start insertion in LoopBB.
-    Builder.SetInsertPoint(LoopBB);
-    
-    // Start the PHI node with an entry for Start.
-    PHINode *Variable = Builder.CreatePHI(Type::getInt64Ty(getGlobalContext()));
-    Variable->addIncoming(StartVal, PreheaderBB);
-
-    // Emit the body of the loop.
-    Value *arrayPos = Builder.CreateGEP(arrVal, Variable);
-    arrayPos = Builder.CreateBitCast(arrayPos, PointerType::getUnqual(contained));
-    Builder.CreateStore(defaultVal, arrayPos);
-    
-    // Emit the step value.
-    Value *StepVal = ConstantInt::get(getGlobalContext(), APInt(64, 1, true));
-    Value *NextVar = Builder.CreateAdd(Variable, StepVal, "nextvar");
-
-    Value *EndCond = Builder.CreateICmpEQ(NextVar, arraySize, "loopcond");
-
-    // Create the "after loop" block and insert it.
-    BasicBlock *LoopEndBB = Builder.GetInsertBlock();
-    BasicBlock *AfterBB = BasicBlock::Create(
-      getGlobalContext(), "afterloop", TheFunction);
-    
-    // Insert the conditional branch into the end of LoopEndBB.
-    Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
-    
-    // Any new code will be inserted in AfterBB.
-    Builder.SetInsertPoint(AfterBB);
-    
-    // Add a new entry to the PHI node for the backedge.
-    Variable->addIncoming(NextVar, LoopEndBB);
+  if (DefaultValue == 0)
+    std::cout << "unexpected null default value." << std::endl;
+  Value *defaultVal = CreateEscapingValue(
+    DefaultValue->Codegen(), Contained, this);
+  const Type *contained = Contained->getType();
+  Value *data = CreateArrayElementPtr(castVal, ConstantInt::get(i64, 0));
+  data = Builder.CreateBitCast(data, PointerType::getUnqual(contained));
+
+  // Constant defaults made of a single repeated byte are a memset, and
+  // zero needs nothing at all when the collector already cleared it.
+  uint64_t byte;
+  if (Constant *c = dyn_cast<Constant>(defaultVal)) {
+    if (c->isNullValue() && !pointerFree)
+      return castVal;
+    if (c->isNullValue() || isByteSplat(c, byte)) {
+      Value *bytes = Builder.CreateMul(arraySize,
+        ConstantExpr::getSizeOf(contained), "fillbytes");
+      CreateMemSet(data, ConstantInt::get(Type::getInt8Ty(ctx),
+        c->isNullValue() ? 0 : byte), bytes);
+      return castVal;
+    }
   }
-  
-  Value *arrPtr = Builder.CreateStructGEP(castVal, 1);
-  Builder.CreateStore(arrVal, arrPtr);
+
+  // Otherwise a canonical counted loop, skipped for an empty array,
+  // that the loop optimizations can unroll and vectorize.
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  BasicBlock *LoopBB = BasicBlock::Create(ctx, "fill", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(ctx, "afterfill");
+  Value *StartVal = ConstantInt::get(i64, 0);
+  Builder.CreateCondBr(
+    Builder.CreateICmpSGT(arraySize, StartVal, "nonempty"), LoopBB, AfterBB);
+
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *Variable = Builder.CreatePHI(i64, "i");
+  Variable->addIncoming(StartVal, PreheaderBB);
+  Builder.CreateStore(defaultVal, Builder.CreateInBoundsGEP(data, Variable));
+  Value *NextVar = Builder.CreateAdd(
+    Variable, ConstantInt::get(i64, 1), "nextvar");
+  Variable->addIncoming(NextVar, LoopBB);
+  Builder.CreateCondBr(
+    Builder.CreateICmpULT(NextVar, arraySize, "loopcond"), LoopBB, AfterBB);
+
+  TheFunction->getBasicBlockList().push_back(AfterBB);
+  Builder.SetInsertPoint(AfterBB);
 
   return castVal;
 }
 
 Value *Constructor::Codegen() {
-  // Heap allocation.
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  // Unboxed structures are built on the stack, the rest on the heap.
   Type const *ty = ThisType->getPassType();
 
-  Function *mallocFunc = TheModule->getFunction("GC_malloc");
-  Value *mallocArg = ConstantExpr::getSizeOf(ty);
-
-  Value *val = Builder.CreateCall(mallocFunc, mallocArg);
-  Value *castVal = Builder.CreateBitCast(val, PointerType::getUnqual(ty));
+  Value *castVal;
+  if (ThisType->isUnboxed()) {
+    castVal = CreateStackSlot(ty, ThisType->getName());
+  } else {
+    Value *mallocArg = ConstantExpr::getSizeOf(ty);
+    Value *val = CreateGCMalloc(
+      mallocArg, !ThisType->hasPointerFields(), this, ThisType->getName());
+    castVal = Builder.CreateBitCast(val, PointerType::getUnqual(ty));
+  }
 
   for (unsigned i=0, e=Args.size(); i != e; ++i) {
     Value *gep = Builder.CreateStructGEP(castVal, i);
-    Value *val = Args[i]->Codegen();
+    Value *val = CreateEscapingValue(
+      Args[i]->Codegen(), ThisType->getSType(i), this);
     Builder.CreateStore(val, gep);
   }
 
@@ -520,10 +1007,11 @@ Value *Constructor::Codegen() {
 Value *Register::Codegen() {
   if (Alloca == NULL) {
     Value *InitVal = Source->Codegen();
-    //Function *TheFunction = Builder.GetInsertBlock()->getParent();
-    //IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-    //  TheFunction->getEntryBlock().begin());
-    Alloca = Builder.CreateAlloca(Source->getType(), 0, Name.c_str());
+    // Keep the slot in the entry block so that mem2reg can promote it.
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+      TheFunction->getEntryBlock().begin());
+    Alloca = TmpB.CreateAlloca(Source->getType(), 0, Name.c_str());
 
     Builder.CreateStore(InitVal, Alloca);
   }
@@ -531,6 +1019,17 @@ Value *Register::Codegen() {
   return Alloca;
 }
 
+Value *LoopVar::Codegen() {
+  if (Alloca == NULL) {
+    // In the entry block, where mem2reg promotes it to the loop's phi.
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+      TheFunction->getEntryBlock().begin());
+    Alloca = TmpB.CreateAlloca(getType(), 0, Name.c_str());
+  }
+  return Alloca;
+}
+
 Value *RegisterFunArg::Codegen() {
   assert(Alloca != NULL);
   return Alloca;
@@ -553,9 +1052,30 @@ Value *If::Codegen() {
 
   BasicBlock *thenBB = BasicBlock::Create(getGlobalContext(), "then", fn);
   BasicBlock *elseBB = BasicBlock::Create(getGlobalContext(), "else");
-  BasicBlock *mergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
   Builder.CreateCondBr(condVal, thenBB, elseBB);
 
+  if (IsTail) {
+    // Each branch returns on its own so that calls in tail position are
+    // immediately followed by their ret. Branches that ended in a self tail
+    // call are already terminated by the jump back to the loop header.
+    Builder.SetInsertPoint(thenBB);
+    Value *thenVal = Then->Codegen();
+    if (thenVal == NULL) return NULL;
+    if (Builder.GetInsertBlock()->getTerminator() == NULL)
+      CreateReturn(thenVal);
+
+    fn->getBasicBlockList().push_back(elseBB);
+    Builder.SetInsertPoint(elseBB);
+    Value *elseVal = Else->Codegen();
+    if (elseVal == NULL) return NULL;
+    if (Builder.GetInsertBlock()->getTerminator() == NULL)
+      CreateReturn(elseVal);
+
+    return UndefValue::get(getType());
+  }
+
+  BasicBlock *mergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
+
   Builder.SetInsertPoint(thenBB);
   Value *thenVal = Then->Codegen();
   if (thenVal == NULL) return NULL;
@@ -580,6 +1100,12 @@ Value *If::Codegen() {
   return pn;
 }
 
+void If::MarkTailCalls() {
+  IsTail = true;
+  Then->MarkTailCalls();
+  Else->MarkTailCalls();
+}
+
 Value *While::Codegen() {
 
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
@@ -603,6 +1129,36 @@ Value *While::Codegen() {
   return NULL;
 }
 
+Value *For::Codegen() {
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i32 = Type::getInt32Ty(ctx);
+
+  // The trip count, and for a foreach the element base pointer, are
+  // computed once ahead of the loop rather than on every iteration.
+  Value *StartVal, *EndVal, *Data = NULL;
+  if (Over == NULL) {
+    StartVal = From->Codegen();
+    EndVal = Until->Codegen();
+  } else {
+    Value *array = Over->Codegen();
+    StartVal = ConstantInt::get(i32, 0);
+    EndVal = Builder.CreateLoad(CreateArrayLengthPtr(array), "len");
+    Data = CreateArrayDataPtr(array, Element->getSourceSType());
+  }
+  Value *Slot = Var->Codegen();
+
+  CountedLoop loop(StartVal, EndVal, "for");
+  if (Data == NULL)
+    Builder.CreateStore(loop.getIndex(), Slot);
+  else
+    Builder.CreateStore(Builder.CreateLoad(
+      Builder.CreateInBoundsGEP(Data, loop.getIndex()), Name.c_str()), Slot);
+  Body->Codegen();
+  loop.finish();
+
+  return NULL;
+}
+
 void Closure::getArgRegs(vector<RegisterFunArg*> &args) {
   vector<RegisterFunArg*> funArgRegs;
   FuncRef->getArgRegs(funArgRegs);
@@ -631,6 +1187,21 @@ void Call::getAllArgs(vector<Expr*> &args) {
     args.push_back(Args[i]);
 }
 
+// The type of a closure value leaves out its activation record, so direct
+// calls go by the type of the function itself.
+SFunctionType *Call::getCalleeSType() {
+  SFunctionType *fty;
+  if (Func *fn = getFunc())
+    fty = fn->getFunctionSType();
+  else
+    fty = dynamic_cast<SFunctionType*>(Callee->getSType());
+  if (fty == NULL) {
+    std::cerr << "Attempting to Call a non-function" << std::endl;
+    exit(1);
+  }
+  return fty;
+}
+
 void Call::getGenerics(vector<SType*> &tys) {
   vector<SType*> callTypes;
   vector<Expr*> args;
@@ -639,12 +1210,7 @@ void Call::getGenerics(vector<SType*> &tys) {
     callTypes.push_back(args[i]->getSType());
 
   vector<SType*> genericBindings;
-  SFunctionType *fty = dynamic_cast<SFunctionType*>(Callee->getSType());
-  if (fty == NULL) {
-    std::cerr << "Attempting to Call a non-function" << std::endl;
-    exit(1);
-  }
-  fty->MatchGenerics(callTypes, genericBindings);
+  getCalleeSType()->MatchGenerics(callTypes, genericBindings);
 
   for (unsigned i=0, e=genericBindings.size(); i != e; ++i)
     if (SGenericType *ty = dynamic_cast<SGenericType*>(genericBindings[i]))
@@ -653,6 +1219,214 @@ void Call::getGenerics(vector<SType*> &tys) {
       tys.push_back(genericBindings[i]);
 }
 
+// A generic function passed as an argument is specialized to the type of
+// the parameter it is passed as. Returns NULL for any other argument.
+Func *Call::getGenericFuncArg(unsigned i, vector<SType*> &gens) {
+  Variable *var = dynamic_cast<Variable*>(Args[i]);
+  if (var == NULL)
+    return NULL;
+  Func *argFn = dynamic_cast<Func*>(var->getBinding());
+  if (argFn == NULL || !argFn->isGeneric())
+    return NULL;
+
+  vector<SType*> &params = getCalleeSType()->getArgs();
+  SFunctionType *paramTy = dynamic_cast<SFunctionType*>(
+    params[params.size() - Args.size() + i]);
+  if (paramTy == NULL)
+    return NULL;
+
+  // Read the parameter type under this call's bindings of the callee.
+  Func *fn = getFunc();
+  vector<SType*> bindings, oldBindings;
+  if (fn != NULL) {
+    getGenerics(bindings);
+    fn->getGenerics(oldBindings);
+    fn->setGenerics(bindings);
+  }
+  vector<SType*> callTypes;
+  vector<SType*> &paramArgs = paramTy->getArgs();
+  for (unsigned j=0, e=paramArgs.size(); j != e; ++j) {
+    SType *ty = paramArgs[j];
+    if (SGenericType *gen = dynamic_cast<SGenericType*>(ty))
+      ty = gen->getBinding();
+    callTypes.push_back(ty);
+  }
+  if (fn != NULL)
+    fn->setGenerics(oldBindings);
+
+  SFunctionType *argTy = argFn->getFunctionSType();
+  if (callTypes.size() != argTy->getArgs().size())
+    return NULL;
+  vector<SType*> matched, placeholders;
+  argTy->MatchGenerics(callTypes, matched);
+  argFn->getGenerics(placeholders);
+  if (matched.size() != placeholders.size())
+    return NULL;
+
+  for (unsigned j=0, e=matched.size(); j != e; ++j)
+    if (SGenericType *ty = dynamic_cast<SGenericType*>(matched[j]))
+      gens.push_back(ty->getBinding());
+    else
+      gens.push_back(matched[j]);
+  return argFn;
+}
+
+// Calls a function value, passing the closure as the environment.
+static CallInst *CreateClosureCall(Value *closure, vector<Value*> &argVals) {
+  Value *code = Builder.CreateLoad(
+    Builder.CreateStructGEP(closure, 0), "code");
+  const FunctionType *codeTy = cast<FunctionType>(
+    cast<PointerType>(code->getType())->getElementType());
+  vector<Value*> args(1, Builder.CreateBitCast(
+    closure, Type::getInt8PtrTy(getGlobalContext()), "env"));
+  args.insert(args.end(), argVals.begin(), argVals.end());
+  for (unsigned i=0, e=args.size(); i != e; ++i)
+    args[i] = Builder.CreateBitCast(args[i], codeTy->getParamType(i));
+
+  CallInst *call = Builder.CreateCall(code,
+    args.begin(), args.end(), "callptr");
+  // Closure code is always generated by getClosureCode.
+  call->setCallingConv(CallingConv::Fast);
+  call->setDoesNotThrow();
+  return call;
+}
+
+// parMap(a, f), parFor(n, f) and parReduce(a, init, f). The loop over one
+// chunk becomes a C callable function of the context it is passed, which
+// holds f and the arrays; spl_par_run calls it on its threads. A reduce
+// leaves one partial result per chunk, combined here in order, so f has
+// to be associative but need not be commutative.
+Value *Call::ParallelCodegen(vector<Value*> &args) {
+  ParallelOp op = getParallelPrimitive(getFunc())->Op;
+  LLVMContext &ctx = getGlobalContext();
+  const Type *i8p = Type::getInt8PtrTy(ctx);
+  const Type *i32 = Type::getInt32Ty(ctx);
+  Value *closure = args.back();
+
+  SArray *sty = op == ParFor ? NULL : dynamic_cast<SArray*>(Args[0]->getSType());
+  SType *elSTy = sty ? sty->getContained() : NULL;
+  SArray *outSTy = op == ParMap ? dynamic_cast<SArray*>(getSType()) : NULL;
+  Value *n = op == ParFor ? args[0]
+    : Builder.CreateLoad(CreateArrayLengthPtr(args[0]), "len");
+  Value *chunks = Builder.CreateCall(TheModule->getOrInsertFunction(
+    "spl_par_chunks", i32, i32, NULL), n, "chunks");
+
+  // What the chunks work on: f, then the input and output arrays.
+  vector<Value*> fields(1, closure);
+  if (op == ParMap) {
+    Value *out = Builder.CreateBitCast(
+      CreateGCMalloc(CreateArrayBytes(outSTy, n), !outSTy->hasPointerFields(),
+        this, outSTy->getName()),
+      outSTy->getType(), "out");
+    Builder.CreateStore(n, CreateArrayLengthPtr(out));
+    fields.push_back(args[0]);
+    fields.push_back(out);
+  } else if (op == ParReduce) {
+    const Type *elTy = elSTy->getType();
+    Value *bytes = Builder.CreateMul(
+      Builder.CreateIntCast(chunks, Type::getInt64Ty(ctx), true),
+      ConstantExpr::getSizeOf(elTy), "partialbytes");
+    fields.push_back(args[0]);
+    fields.push_back(Builder.CreateBitCast(
+      CreateGCMalloc(bytes, !elSTy->containsPointers(), this, "parReduce"),
+      PointerType::getUnqual(elTy), "partials"));
+  }
+  vector<const Type*> fieldTys;
+  for (unsigned i=0, e=fields.size(); i != e; ++i)
+    fieldTys.push_back(fields[i]->getType());
+  const StructType *ctxTy = StructType::get(ctx, fieldTys);
+
+  Function *caller = Builder.GetInsertBlock()->getParent();
+  IRBuilder<> TmpB(&caller->getEntryBlock(), caller->getEntryBlock().begin());
+  Value *ctxVal = TmpB.CreateAlloca(ctxTy, 0, "parctx");
+  for (unsigned i=0, e=fields.size(); i != e; ++i)
+    Builder.CreateStore(fields[i], Builder.CreateStructGEP(ctxVal, i));
+
+  // The chunk function: void (i8 *ctx, i32 chunk, i32 begin, i32 end).
+  vector<const Type*> chunkArgs(1, i8p);
+  chunkArgs.insert(chunkArgs.end(), 3, i32);
+  Function *chunkFn = Function::Create(
+    FunctionType::get(Type::getVoidTy(ctx), chunkArgs, false),
+    Function::InternalLinkage, caller->getName() + "$par", TheModule);
+  chunkFn->setDoesNotThrow();
+  BasicBlock *SavedBB = Builder.GetInsertBlock();
+  BasicBlock::iterator SavedPt = Builder.GetInsertPoint();
+  Builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", chunkFn));
+  {
+    Function::arg_iterator ai = chunkFn->arg_begin();
+    Value *env = Builder.CreateBitCast(ai++, PointerType::getUnqual(ctxTy));
+    Value *chunk = ai++, *begin = ai++, *end = ai++;
+    Value *fn = Builder.CreateLoad(Builder.CreateStructGEP(env, 0), "f");
+
+    if (op == ParFor) {
+      CountedLoop loop(begin, end, "parfor");
+      vector<Value*> callArgs(1, loop.getIndex());
+      CreateClosureCall(fn, callArgs);
+      loop.finish();
+    } else {
+      Value *in = CreateArrayDataPtr(
+        Builder.CreateLoad(Builder.CreateStructGEP(env, 1)), sty);
+      const Type *elTy = elSTy->getType();
+      if (op == ParMap) {
+        Value *out = CreateArrayDataPtr(
+          Builder.CreateLoad(Builder.CreateStructGEP(env, 2)), outSTy);
+        CountedLoop loop(begin, end, "parmap");
+        vector<Value*> callArgs(1, Builder.CreateLoad(
+          Builder.CreateInBoundsGEP(in, loop.getIndex()), "x"));
+        Builder.CreateStore(
+          Builder.CreateBitCast(CreateClosureCall(fn, callArgs),
+            outSTy->getContained()->getType()),
+          Builder.CreateInBoundsGEP(out, loop.getIndex()));
+        loop.finish();
+      } else {
+        // Chunks are never empty, so each starts from its first element.
+        Value *acc = Builder.CreateAlloca(elTy, 0, "acc");
+        Builder.CreateStore(
+          Builder.CreateLoad(Builder.CreateInBoundsGEP(in, begin)), acc);
+        CountedLoop loop(Builder.CreateNSWAdd(begin,
+          ConstantInt::get(i32, 1)), end, "parreduce");
+        vector<Value*> callArgs;
+        callArgs.push_back(Builder.CreateLoad(acc));
+        callArgs.push_back(Builder.CreateLoad(
+          Builder.CreateInBoundsGEP(in, loop.getIndex()), "x"));
+        Builder.CreateStore(
+          Builder.CreateBitCast(CreateClosureCall(fn, callArgs), elTy), acc);
+        loop.finish();
+        Value *partials = Builder.CreateLoad(Builder.CreateStructGEP(env, 2));
+        Builder.CreateStore(Builder.CreateLoad(acc),
+          Builder.CreateInBoundsGEP(partials, chunk));
+      }
+    }
+    Builder.CreateRetVoid();
+  }
+  Builder.SetInsertPoint(SavedBB, SavedPt);
+
+  Value *runArgs[] = {
+    n, chunks, Builder.CreateBitCast(chunkFn, i8p),
+    Builder.CreateBitCast(ctxVal, i8p)
+  };
+  Builder.CreateCall(TheModule->getOrInsertFunction("spl_par_run",
+    Type::getVoidTy(ctx), i32, i32, i8p, i8p, NULL), runArgs, runArgs + 4);
+
+  if (op == ParFor)
+    return n;
+  if (op == ParMap)
+    return fields[2];
+
+  // Fold the partial results into init, chunk by chunk.
+  Value *acc = TmpB.CreateAlloca(elSTy->getType(), 0, "reduced");
+  Builder.CreateStore(args[1], acc);
+  CountedLoop loop(ConstantInt::get(i32, 0), chunks, "combine");
+  vector<Value*> callArgs;
+  callArgs.push_back(Builder.CreateLoad(acc));
+  callArgs.push_back(Builder.CreateLoad(
+    Builder.CreateInBoundsGEP(fields[2], loop.getIndex()), "partial"));
+  Builder.CreateStore(Builder.CreateBitCast(
+    CreateClosureCall(closure, callArgs), elSTy->getType()), acc);
+  loop.finish();
+  return Builder.CreateLoad(acc, "reduced");
+}
+
 Value *Call::Codegen() {
   vector<Value*> argVals;
 
@@ -660,11 +1434,24 @@ Value *Call::Codegen() {
     // First arguments to call are the closure's activation record.
     vector<Expr*> *ar = cl->getActivationRecord();
     for (unsigned i=0, e=ar->size(); i != e; ++i)
-      argVals.push_back((*ar)[i]->Codegen());
+      argVals.push_back(CreateLoadBinding((*ar)[i], "captured"));
   }
 
-  for (unsigned i=0, e=Args.size(); i != e; ++i)
-    argVals.push_back(Args[i]->Codegen());
+  for (unsigned i=0, e=Args.size(); i != e; ++i) {
+    vector<SType*> argBindings;
+    if (Func *argFn = getGenericFuncArg(i, argBindings)) {
+      vector<SType*> oldArgBindings;
+      argFn->getGenerics(oldArgBindings);
+      argFn->setGenerics(argBindings);
+      argVals.push_back(argFn->getClosure());
+      argFn->setGenerics(oldArgBindings);
+    } else {
+      argVals.push_back(Args[i]->Codegen());
+    }
+  }
+
+  if (getParallelPrimitive(getFunc()) != NULL)
+    return ParallelCodegen(argVals);
 
   Value *val;
   if (Func *fn = getFunc()) {
@@ -679,30 +1466,113 @@ Value *Call::Codegen() {
       argVals[i] = Builder.CreateBitCast(argVals[i], tys[i]->getType());
     }
 
-    Value *fnPtr = fn->getFunction();
-    val = Builder.CreateCall(fnPtr, argVals.begin(), argVals.end(), "calltmp");
+    Function *fnPtr = fn->getFunction();
+    Function *current = Builder.GetInsertBlock()->getParent();
+    if (IsTail && fnPtr == current && fn->getRecurseBlock() != NULL) {
+      // Self tail call: rebind the arguments and jump back to the top.
+      // Unboxed ones are copied into the slots of the current ones, which
+      // they may point into, so all of them are loaded first.
+      vector<RegisterFunArg*> argRegs;
+      fn->getArgRegs(argRegs);
+      for (unsigned i=0, e=argVals.size(); i != e; ++i)
+        if (getUnboxedSType(tys[i]))
+          argVals[i] = Builder.CreateLoad(argVals[i], "unbox");
+      for (unsigned i=0, e=argVals.size(); i != e; ++i) {
+        Value *slot = argRegs[i]->getAlloca();
+        if (getUnboxedSType(tys[i]))
+          slot = Builder.CreateLoad(slot);
+        Builder.CreateStore(argVals[i], slot);
+      }
+      Builder.CreateBr(fn->getRecurseBlock());
+      fn->setGenerics(oldGenericBindings);
+      return UndefValue::get(getSType()->getType());
+    }
+
+    // Externs are C functions and take every structure by pointer.
+    bool direct = dynamic_cast<Extern*>(fn) == NULL;
+    for (unsigned i=0, e=argVals.size(); i != e; ++i)
+      if (!direct)
+        argVals[i] = CreateEscapingValue(argVals[i], tys[i], this);
+      else if (getUnboxedSType(tys[i]))
+        argVals[i] = Builder.CreateLoad(argVals[i], "unbox");
+
+    CallInst *call =
+      Builder.CreateCall(fnPtr, argVals.begin(), argVals.end(), "calltmp");
+    call->setCallingConv(fnPtr->getCallingConv());
+    if (IsTail)
+      call->setTailCall();
+    val = call;
+    SType *retSTy = fn->getFunctionSType()->getReturnType();
+    if (IsTail && direct && getUnboxedSType(retSTy) &&
+        current->getReturnType() == call->getType()) {
+      // Returned as is: boxing it only to unbox it again for the ret
+      // would cost an allocation and take the call out of tail position.
+      Builder.CreateRet(call);
+      fn->setGenerics(oldGenericBindings);
+      return UndefValue::get(getSType()->getType());
+    }
+    if (direct && getUnboxedSType(retSTy))
+      val = CreateUnboxed(val, "ret");
     val = Builder.CreateBitCast(val, getSType()->getType());
 
     fn->setGenerics(oldGenericBindings);
 
   } else {
-    Value *CalleeVal = Callee->Codegen();
-    Value *fnPtr = Builder.CreateLoad(CalleeVal);
-
-    val = Builder.CreateCall(fnPtr,
-      argVals.begin(), argVals.end(), "callptr");
+    // Call through the closure, passing it as the environment. A tail
+    // call must not be passed the slots of this function.
+    unsigned first = argVals.size() - Args.size();
+    for (unsigned i=0, e=Args.size(); IsTail && i != e; ++i)
+      argVals[first + i] =
+        CreateEscapingValue(argVals[first + i], Args[i]->getSType(), this);
+    CallInst *call =
+      CreateClosureCall(CreateLoadBinding(Callee, CalleeName), argVals);
+    if (IsTail)
+      call->setTailCall();
+    val = Builder.CreateBitCast(call, getSType()->getType());
   }
 
   return val;
 }
 
+// The environment of a closure: its code, followed by the values of the
+// first numEnv arguments of the function.
+static const StructType *getClosureEnvType(
+    Function *code, Func *fn, unsigned numEnv) {
+  vector<SType*> &argSTys = fn->getFunctionSType()->getArgs();
+  vector<const Type*> fields(1, code->getType());
+  for (unsigned i=0; i != numEnv; ++i)
+    fields.push_back(argSTys[i]->getType());
+  return StructType::get(getGlobalContext(), fields);
+}
+
 Value *Closure::Codegen() {
-  // XXX
-  // XXX: serious problem here, a closure can refer to a generic function
-  // that is specialized in two ways. Need to have the right reference here.
-  // XXX
-  // XXX
-  return FuncRef->getFunction();
+  // Bindings of the activation record are fixed when the closure is made.
+  unsigned numEnv = ActivationRecord.size();
+  if (numEnv == 0)
+    return ConstantExpr::getBitCast(FuncRef->getClosure(), getType());
+
+  Function *code = FuncRef->getClosureCode(numEnv);
+  const StructType *envTy = getClosureEnvType(code, FuncRef, numEnv);
+
+  bool pointerFree = true;
+  for (unsigned i=0; i != numEnv; ++i)
+    if (ActivationRecord[i]->getSType()->containsPointers())
+      pointerFree = false;
+  Value *env = Builder.CreateBitCast(
+    CreateGCMalloc(ConstantExpr::getSizeOf(envTy), pointerFree, this,
+      "closure " + FuncName),
+    PointerType::getUnqual(envTy), "closure");
+
+  Builder.CreateStore(code, Builder.CreateStructGEP(env, 0));
+  for (unsigned i=0; i != numEnv; ++i) {
+    Value *val = CreateEscapingValue(
+      CreateLoadBinding(ActivationRecord[i], "captured"),
+      ActivationRecord[i]->getSType(), this);
+    Builder.CreateStore(
+      Builder.CreateBitCast(val, envTy->getElementType(i + 1)),
+      Builder.CreateStructGEP(env, i + 1));
+  }
+  return Builder.CreateBitCast(env, getType());
 }
 
 Function *Extern::getFunction() {
@@ -710,6 +1580,11 @@ Function *Extern::getFunction() {
   if (func == NULL) {
     FunctionType const *ft = getFunctionSType()->getFunctionType();
     func = Function::Create(ft, Function::ExternalLinkage, GetName(), TheModule);
+    // Taken on trust from the declaration: a def extern may read what it
+    // is passed but changes nothing, so its calls can be combined.
+    func->setDoesNotThrow();
+    if (getPurity() == Pure)
+      func->setOnlyReadsMemory();
   }
   return func;
 }
@@ -722,7 +1597,7 @@ Function *Func::getFunction() {
   if (functions.count(genericBindings) > 0)
     return functions[genericBindings];
 
-  FunctionType const *ft = getFunctionSType()->getFunctionType();
+  FunctionType const *ft = getDirectFunctionType(getFunctionSType());
   //std::cerr << "FunctionType " << Name << " type: ";
   //ft->dump();
   //std::cerr << std::endl;
@@ -737,6 +1612,12 @@ Function *Func::getFunction() {
     exit(1);
   }
 
+  // fastcc lets the code generator guarantee tail call elimination. main is
+  // called from the outside and keeps the C convention.
+  if (name != "main")
+    function->setCallingConv(CallingConv::Fast);
+  function->setDoesNotThrow();
+
   unsigned idx = 0;
   for (Function::arg_iterator ai=function->arg_begin(); idx != Args.size();
       ++ai,++idx)
@@ -747,6 +1628,19 @@ Function *Func::getFunction() {
   return function;
 }
 
+void Func::remapFunctions(Module *m) {
+  map<vector<SType*>,Function*>::iterator it = functions.begin();
+  while (it != functions.end()) {
+    map<vector<SType*>,Function*>::iterator next = it;
+    ++next;
+    if (Function *fn = m->getFunction(it->second->getName()))
+      it->second = fn;
+    else
+      functions.erase(it);
+    it = next;
+  }
+}
+
 void Func::getFullName(string &name) {
   name.assign(Name);
 
@@ -779,12 +1673,88 @@ void Func::clearGenerics() {
     GenericPlaceholders[i]->setBinding(NULL);
 }
 
+// The code of a function value. It forwards to the function, loading the
+// first numEnv arguments from the closure object passed in as environment.
+// Function values keep every structure boxed, the code unboxes them for
+// the function.
+Function *Func::getClosureCode(unsigned numEnv) {
+  Function *function = getFunction();
+  string name(function->getName().str() + "$code");
+  if (Function *code = TheModule->getFunction(name))
+    return code;
+
+  LLVMContext &ctx = getGlobalContext();
+  SFunctionType *fty = getFunctionSType();
+  vector<SType*> &argSTys = fty->getArgs();
+  vector<const Type*> argTys(1, Type::getInt8PtrTy(ctx));
+  for (unsigned i=numEnv, e=argSTys.size(); i != e; ++i)
+    argTys.push_back(argSTys[i]->getType());
+  Function *code = Function::Create(
+    FunctionType::get(fty->getReturnType()->getType(), argTys, false),
+    Function::InternalLinkage, name, TheModule);
+  code->setCallingConv(CallingConv::Fast);
+  code->setDoesNotThrow();
+
+  BasicBlock *SavedBB = Builder.GetInsertBlock();
+  BasicBlock::iterator SavedPt = Builder.GetInsertPoint();
+  Builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", code));
+  Function::arg_iterator ai = code->arg_begin();
+  vector<Value*> args;
+  if (numEnv > 0) {
+    const StructType *envTy = getClosureEnvType(code, this, numEnv);
+    Value *env = Builder.CreateBitCast(ai, PointerType::getUnqual(envTy), "env");
+    for (unsigned i=0; i != numEnv; ++i)
+      args.push_back(Builder.CreateLoad(Builder.CreateStructGEP(env, i + 1)));
+  }
+  for (++ai; ai != code->arg_end(); ++ai)
+    args.push_back(ai);
+  for (unsigned i=0, e=args.size(); i != e; ++i)
+    if (getUnboxedSType(argSTys[i]))
+      args[i] = Builder.CreateLoad(args[i], "unbox");
+
+  CallInst *call = Builder.CreateCall(function, args.begin(), args.end());
+  call->setCallingConv(function->getCallingConv());
+  Value *ret = call;
+  if (SStructType *sty = getUnboxedSType(fty->getReturnType()))
+    ret = CreateBox(ret, sty, this);
+  else
+    call->setTailCall();
+  if (call->getType()->isVoidTy())
+    Builder.CreateRetVoid();
+  else
+    Builder.CreateRet(ret);
+
+  if (SavedBB != NULL)
+    Builder.SetInsertPoint(SavedBB, SavedPt);
+  return code;
+}
+
+// A function without captured variables is a constant closure, one per
+// specialization.
+Constant *Func::getClosure() {
+  Function *code = getClosureCode(0);
+  string name(getFunction()->getName().str() + "$closure");
+  GlobalVariable *glb = TheModule->getNamedGlobal(name);
+  if (glb == NULL) {
+    Constant *init = ConstantStruct::get(
+      getGlobalContext(), vector<Constant*>(1, code), false);
+    glb = new GlobalVariable(*TheModule, init->getType(), true,
+      GlobalValue::InternalLinkage, init, name);
+  }
+  return ConstantExpr::getBitCast(glb, getType());
+}
+
+// Lifted functions take their captured variables as leading arguments,
+// which have no type annotation.
+unsigned Func::getNumCaptured() {
+  unsigned n = 0;
+  while (n != ArgSTypeNames.size() && ArgSTypeNames[n] == NULL)
+    ++n;
+  return n;
+}
+
 Value *Func::Codegen() {
-  Value *fn = getFunction();
-  AllocaInst *alloca = Builder.CreateAlloca(
-    getType(), 0, GetName());
-  Builder.CreateStore(fn, alloca);
-  return alloca;
+  return getClosure();
 }
 
 Value *Func::Gen() {
@@ -802,11 +1772,21 @@ Value *Func::Gen() {
       function->getEntryBlock().begin());
     AllocaInst *alloca = TmpB.CreateAlloca(
       ArgSTypes[idx]->getType(), 0, Args[idx].c_str());
-    Builder.CreateStore(ai, alloca);
+    Value *arg = ai;
+    if (getUnboxedSType(ArgSTypes[idx]))
+      arg = CreateUnboxed(arg, Args[idx] + ".val");
+    Builder.CreateStore(arg, alloca);
     ArgRegs[idx]->setAlloca(alloca);
   }
 
+  // Self tail calls store new arguments and branch back here.
+  RecurseBB = BasicBlock::Create(getGlobalContext(), "tailrecurse", function);
+  Builder.CreateBr(RecurseBB);
+  Builder.SetInsertPoint(RecurseBB);
+
+  Body->MarkTailCalls();
   Value *ret = Body->Codegen();
+  RecurseBB = NULL;
 
   if (ret == NULL) {
     function->eraseFromParent();
@@ -814,7 +1794,8 @@ Value *Func::Gen() {
     return NULL;
   }
 
-  Builder.CreateRet(ret);
+  if (Builder.GetInsertBlock()->getTerminator() == NULL)
+    CreateReturn(ret);
   if (llvm::DebugFlag)
     function->dump();
   verifyFunction(*function);
@@ -831,7 +1812,24 @@ File::File(string &name,
     Funcs(funcs),
     Externs(externs),
     STypes(tys),
-    FileModule(name, getGlobalContext()) {}
+    FileModule(new Module(name, getGlobalContext())),
+    NumCompiledFuncs(0), NumCompiledExterns(0), NumGenerated(0) {
+  Source src;
+  src.Name = name;
+  src.Funcs = funcs;
+  src.Externs = externs;
+  src.STypes = tys;
+  Sources.push_back(src);
+}
+
+void File::getDefinedNames(vector<string> &names) {
+  for (unsigned i=0, e=Funcs.size(); i != e; ++i)
+    names.push_back(Funcs[i]->GetName());
+  for (unsigned i=0, e=Externs.size(); i != e; ++i)
+    names.push_back(Externs[i]->GetName());
+  for (unsigned i=0, e=STypes.size(); i != e; ++i)
+    names.push_back(STypes[i]->getName());
+}
 
 void File::merge(File &otherFile) {
   for (unsigned i=0, e=otherFile.Funcs.size(); i != e; ++i)
@@ -840,26 +1838,80 @@ void File::merge(File &otherFile) {
     Externs.push_back(otherFile.Externs[i]);
   for (unsigned i=0, e=otherFile.STypes.size(); i != e; ++i)
     STypes.push_back(otherFile.STypes[i]);
-}
-
-void File::optimize() {
-  FunctionPassManager fpm(&FileModule);
-  fpm.doInitialization();
-  createStandardFunctionPasses(&fpm, 2);
-  iplist<Function> &fns = TheModule->getFunctionList();
-  for (iplist<Function>::iterator it = fns.begin(); it != fns.end(); it++)
-    fpm.run(*it);
+  Sources.insert(
+    Sources.end(), otherFile.Sources.begin(), otherFile.Sources.end());
+}
+
+void addFunctionPasses(FunctionPassManager &fpm, unsigned level) {
+  fpm.add(createPromoteMemoryToRegisterPass());
+  fpm.add(createHeapToStackPass());
+  SPL::addStandardFunctionPasses(fpm, level);
+}
+
+void File::optimize(unsigned level, unsigned jobs) {
+  if (jobs > 1) {
+    // What was generated so far refers to the old module by pointer.
+    Module *optimized = optimizeFunctionsInParallel(FileModule, level, jobs);
+    for (unsigned i=0, e=Funcs.size(); i != e; ++i)
+      Funcs[i]->remapFunctions(optimized);
+    map<string,Constant*>::iterator it = StringLiterals.begin();
+    while (it != StringLiterals.end()) {
+      map<string,Constant*>::iterator next = it;
+      ++next;
+      GlobalVariable *glb = optimized->getNamedGlobal(
+        it->second->stripPointerCasts()->getName());
+      if (glb != NULL)
+        it->second = ConstantExpr::getBitCast(glb, SString::get()->getType());
+      else
+        StringLiterals.erase(it);
+      it = next;
+    }
+    delete FileModule;
+    FileModule = TheModule = optimized;
+  } else {
+    FunctionPassManager fpm(FileModule);
+    addFunctionPasses(fpm, level);
+    fpm.doInitialization();
+    iplist<Function> &fns = FileModule->getFunctionList();
+    for (iplist<Function>::iterator it = fns.begin(); it != fns.end(); it++)
+      fpm.run(*it);
+    fpm.doFinalization();
+  }
 
   PassManager pm;
-  createStandardModulePasses(&pm, 2, false, false, true, true, false, NULL);
-  pm.run(FileModule);
+  SPL::addStandardModulePasses(pm, level);
+  pm.run(*FileModule);
+}
+
+bool TimePhases = false;
+bool ProfileAllocs = false;
+const char *const PhaseTimerGroup = "SPL compiler phases";
+
+namespace {
+// Marks the phases of a compilation one after the other, for -debug and
+// -time-phases: each phase lasts until the next one starts.
+class Phases {
+  NamedRegionTimer *Current;
+public:
+  Phases(): Current(NULL) {}
+  ~Phases() { delete Current; }
+  void start(const char *name) {
+    DEBUG(dbgs() << "PHASE: " << name << "\n");
+    delete Current;
+    Current = TimePhases ? new NamedRegionTimer(name, PhaseTimerGroup) : NULL;
+  }
+};
 }
 
-void File::compile() {
+void File::compile(CompileCache *cache) {
   string errStr;
-  TheModule = &FileModule;
+  Phases phases;
+  TheModule = FileModule;
+  if (NumCompiledFuncs == 0)
+    StringLiterals.clear();
+  unsigned firstFunc = NumCompiledFuncs, firstExtern = NumCompiledExterns;
 
-  DEBUG(dbgs() << "PHASE: Init\n");
+  phases.start("Init");
   {
     const FunctionType *mallocTy = FunctionType::get(
       Type::getInt8PtrTy(getGlobalContext()),
@@ -882,12 +1934,31 @@ void File::compile() {
     if (printFunc == 0)
       printFunc = Function::Create(
         printTy, Function::ExternalLinkage, "print", TheModule);
+
+    // Fresh memory every time, which lets the optimizer see that stores
+    // to one allocation leave all the others alone.
+    mallocFunc->setDoesNotThrow();
+    mallocFunc->setDoesNotAlias(0);
+    mallocAtomicFunc->setDoesNotThrow();
+    mallocAtomicFunc->setDoesNotAlias(0);
+    printFunc->setDoesNotThrow();
+
+    if (ProfileAllocs && TheModule->getFunction("spl_alloc_profiled") == 0) {
+      LLVMContext &ctx = getGlobalContext();
+      vector<const Type*> args;
+      args.push_back(Type::getInt64Ty(ctx));
+      args.push_back(Type::getInt32Ty(ctx));
+      args.push_back(Type::getInt8PtrTy(ctx));
+      Function::Create(
+        FunctionType::get(Type::getInt8PtrTy(ctx), args, false),
+        Function::ExternalLinkage, "spl_alloc_profiled", TheModule);
+    }
   }
 
-  DEBUG(dbgs() << "PHASE: LambdaLift\n");
-  LambdaLiftFuncs();
+  phases.start("LambdaLift");
+  LambdaLiftFuncs(firstFunc);
 
-  DEBUG(dbgs() << "PHASE: BindTypes\n");
+  phases.start("BindTypes");
   NamedTypes = SType::Builtins();
   for (vector<SType*>::const_iterator i=STypes.begin(); i!=STypes.end(); i++) {
     // TODO check for overloading primitive NamedTypes.count((*i)->getName())
@@ -910,54 +1981,97 @@ void File::compile() {
     NamedExprs[Externs[i]->GetName()] = Externs[i];
 
   // PHASE: BindNames.
-  DEBUG(dbgs() << "PHASE: BindNames\n");
-  for (unsigned i=0, e=Externs.size(); i != e; ++i)
+  phases.start("BindNames");
+  for (unsigned i=firstExtern, e=Externs.size(); i != e; ++i)
     Externs[i]->Bind(NamedExprs);
-  for (vector<Func*>::const_iterator i=Funcs.begin(); i!=Funcs.end(); i++)
-    (*i)->Bind(NamedExprs);
+  for (unsigned i=firstFunc, e=Funcs.size(); i != e; ++i)
+    Funcs[i]->Bind(NamedExprs);
 
   // PHASE: Type inference.
   {
-    DEBUG(dbgs() << "PHASE: TypeInference\n");
-    for (vector<Func*>::const_iterator i=Funcs.begin(); i!=Funcs.end(); i++) {
-      //std::cerr << "Type inference on: " << (*i)->getName() << std::endl;
+    phases.start("TypeInference");
+    for (unsigned i=firstFunc, e=Funcs.size(); i != e; ++i) {
+      //std::cerr << "Type inference on: " << Funcs[i]->getName() << std::endl;
+      NamedRegionTimer timer(
+        Funcs[i]->GetName(), "Type inference per function", TimePhases);
       TypeInferer inferer;
-      (*i)->TypeInfer(inferer);
+      Funcs[i]->TypeInfer(inferer);
       inferer.TypeUnification();
       inferer.TypePopulation();
+      Funcs[i]->inferReturnType();
     }
   }
 
   // PHASE: Specialization Codegen
   {
-    DEBUG(dbgs() << "PHASE: Specialization Codegen\n");
-
-    // Generate a call graph (using `FindCalls') from every non-generic
-    // function, use this to generate specialized versions of generics.
-    vector<pair<Func*,vector<SType*> > > calls;
-    for (vector<Func*>::const_iterator i=Funcs.begin(); i!=Funcs.end(); i++)
-      if (!(*i)->isGeneric())
-        (*i)->FindCalls(calls);
-    Util::removeDuplicates(calls);
-
-    vector<pair<Func*,vector<SType*> > >::iterator it;
-    for (it=calls.begin(); it != calls.end(); ++it) {
-      if (!Util::allNull(it->second)) {
-        Func *fn = it->first;
-        fn->setGenerics(it->second);
-        fn->Gen();
-        fn->clearGenerics();
-      }
+    phases.start("Specialization");
+
+    // Specialize what is reachable from main, walking each (function,
+    // type arguments) pair once. Without a main, as when compiling a
+    // library, every non-generic function is a root. Later compiles take
+    // their roots from the new functions only, and skip what is done.
+    Specializations &calls = Specialized;
+    unsigned firstSpec = NumGenerated;
+    for (unsigned i=firstFunc, e=Funcs.size(); i != e; ++i)
+      if (Funcs[i]->GetName() == "main")
+        calls.add(Funcs[i], vector<SType*>());
+    if (calls.size() == firstSpec)
+      for (unsigned i=firstFunc, e=Funcs.size(); i != e; ++i)
+        if (!Funcs[i]->isGeneric())
+          calls.add(Funcs[i], vector<SType*>());
+
+    for (unsigned i=firstSpec; i != calls.size(); ++i) {
+      Func *fn = calls[i].first;
+      fn->setGenerics(calls[i].second);
+      fn->FindCalls(calls);
+      fn->clearGenerics();
     }
-  }
-
-  // PHASE: Code generation
-  DEBUG(dbgs() << "PHASE: Func Gen\n");
-  for (unsigned i=0, e=Externs.size(); i != e; ++i)
-    Externs[i]->Gen();
-  for (vector<Func*>::const_iterator i=Funcs.begin(); i!=Funcs.end(); i++) {
-    // TODO: pass in the LLVM state as an argument.
-    (*i)->Gen();
+    DEBUG(dbgs() << "Reachable specializations: "
+                 << calls.size() - firstSpec << "\n");
+
+    // Functions whose code the cache already has are only declared, by
+    // their callers, and linked in afterwards.
+    set<Func*> prebuilt;
+    if (cache != NULL)
+      cache->lookup(Sources, prebuilt);
+
+    // PHASE: Code generation
+    phases.start("Func Gen");
+    for (unsigned i=firstExtern, e=Externs.size(); i != e; ++i)
+      Externs[i]->Gen();
+    for (unsigned i=firstSpec; i != calls.size(); ++i) {
+      // Serial by design, see partition.cpp.
+      Func *fn = calls[i].first;
+      if (prebuilt.count(fn))
+        continue;
+      fn->setGenerics(calls[i].second);
+      string name;
+      fn->getFullName(name);
+      NamedRegionTimer timer(name, "Code generation per function", TimePhases);
+      fn->Gen();
+      fn->clearGenerics();
+      ++NumSpecializations;
+    }
+    NumCompiledFuncs = Funcs.size();
+    NumCompiledExterns = Externs.size();
+    NumGenerated = calls.size();
+
+    for (Module::iterator f = TheModule->begin(); f != TheModule->end(); ++f)
+      for (Function::iterator bb = f->begin(); bb != f->end(); ++bb)
+        NumInstructions += bb->size();
+
+    if (cache != NULL)
+      cache->update(TheModule);
+
+    // A program is entered only through main, so everything else is
+    // private to it: unused specializations can go, and the optimizer
+    // sees every call of a function when changing its arguments or
+    // inferring its memory effects. Libraries keep their names.
+    Function *mainFn = TheModule->getFunction("main");
+    if (mainFn != NULL && !mainFn->isDeclaration())
+      for (Module::iterator f = TheModule->begin(); f != TheModule->end(); ++f)
+        if (!f->isDeclaration() && &*f != mainFn)
+          f->setLinkage(GlobalValue::InternalLinkage);
   }
 }
 
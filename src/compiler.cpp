@@ -1,34 +1,79 @@
 #include "ast.h"
+#include "native.h"
+#include "pipeline.h"
+#include <cstdio>
 #include <iostream>
-#include <fstream>
+#include "llvm/Pass.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 
 using namespace SPL;
 namespace cl=llvm::cl;
 
 extern int yyparse();
-extern std::istream *codein;
+extern const char *CodeCur;
+extern const char *CodeEnd;
 extern std::vector<AST::Func*>      toplevel;
 extern std::vector<AST::Extern*>    externs;
 extern std::vector<AST::SType*>     types;
 extern int line;
 extern int col;
 
+// src/prelude.spl, embedded by the build (build/prelude_spl.cpp).
+extern const char PreludeSource[];
+
 cl::list<std::string> InputFilenames(
   cl::Positional, cl::desc("<input file>"), cl::OneOrMore);
 cl::opt<std::string> OutputFilename(
   "o", cl::desc("Output file name"), cl::value_desc("file"), cl::Prefix);
-cl::opt<bool> Optimize("O", cl::desc("Optimize"));
-
-static AST::File *parseFile(std::string& fileName) {
-  std::ifstream infile(fileName.c_str());
-  if (!infile.is_open()) {
-    std::cerr << "Unable to open file: " << fileName << std::endl;
-    exit(1);
-  }
-  codein = &infile;
+cl::opt<char> OptLevel(
+  "O", cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default -O0)"),
+  cl::Prefix, cl::ZeroOrMore, cl::init('0'));
+
+enum OutputKind { BitcodeFile, AssemblyFile, ObjectFile, ExecutableFile };
+cl::opt<OutputKind> FileType(
+  "filetype", cl::desc("Kind of output file"), cl::init(BitcodeFile),
+  cl::values(
+    clEnumValN(BitcodeFile, "bc", "LLVM bitcode, to run with splvm"),
+    clEnumValN(AssemblyFile, "asm", "Native assembly"),
+    clEnumValN(ObjectFile, "obj", "Native object file"),
+    clEnumValN(ExecutableFile, "exe", "Native executable"),
+    clEnumValEnd));
+cl::opt<std::string> RuntimeFilename(
+  "runtime", cl::desc("Runtime library to link executables with"),
+  cl::value_desc("file"), cl::init(SPL_RUNTIME));
+cl::opt<std::string> PreludeFilename(
+  "prelude", cl::desc("Use this prelude instead of the built-in one"),
+  cl::value_desc("file"));
+cl::opt<std::string> CacheDir(
+  "cache-dir", cl::desc("Reuse the code of unchanged files from this directory"),
+  cl::value_desc("dir"));
+cl::opt<bool, true> TimePhases(
+  "time-phases", cl::desc("Time each compiler phase and optimization pass"),
+  cl::location(AST::TimePhases));
+cl::opt<bool, true> ProfileAllocs(
+  "profile-allocs", cl::desc("Count heap allocations by source location"),
+  cl::location(AST::ProfileAllocs));
+cl::opt<unsigned> Jobs(
+  "j", cl::desc("Number of threads to optimize with"), cl::value_desc("N"),
+  cl::init(1), cl::Prefix);
+
+static AST::CompileCache *Cache = NULL;
+
+// The lexer reads the buffer in place; tokens are copied out only when
+// the AST keeps them, so the buffer need not outlive the parse.
+static AST::File *parseBuffer(const llvm::MemoryBuffer &buf,
+                              std::string &fileName) {
+  llvm::NamedRegionTimer timer("Parse", AST::PhaseTimerGroup, TimePhases);
+
+  if (Cache != NULL)
+    Cache->addText(fileName, buf.getBuffer());
+  CodeCur = buf.getBufferStart();
+  CodeEnd = buf.getBufferEnd();
   line = 1;
   col = 0;
 
@@ -47,32 +92,100 @@ static AST::File *parseFile(std::string& fileName) {
   return file;
 }
 
+static AST::File *parseFile(std::string &fileName) {
+  // Large files are mapped rather than read.
+  llvm::MemoryBuffer *buf = llvm::MemoryBuffer::getFile(fileName);
+  if (buf == NULL) {
+    std::cerr << "Unable to open file: " << fileName << std::endl;
+    exit(1);
+  }
+  AST::File *file = parseBuffer(*buf, fileName);
+  delete buf;
+  return file;
+}
+
+static AST::File *parsePrelude() {
+  if (!PreludeFilename.empty())
+    return parseFile(PreludeFilename);
+  std::string name("<prelude>");
+  llvm::MemoryBuffer *buf =
+    llvm::MemoryBuffer::getMemBuffer(PreludeSource, name);
+  AST::File *file = parseBuffer(*buf, name);
+  delete buf;
+  return file;
+}
+
 int main(int argc, char** argv)
 {
+  // Prints the -time-phases and -stats reports on the way out.
+  llvm::llvm_shutdown_obj shutdown;
   llvm::EnableDebugBuffering = true;
   llvm::cl::ParseCommandLineOptions(argc, argv, "Sprint Compiler");
+  llvm::TimePassesIsEnabled |= TimePhases;
 
+  static const char *defaultOutputs[] = { "junk.bc", "junk.s", "junk.o", "a.out" };
   std::string outFile(
-    OutputFilename.empty() ? std::string("junk.bc") : OutputFilename);
+    OutputFilename.empty() ? std::string(defaultOutputs[FileType])
+                           : OutputFilename);
 
-  // TODO: bake the prelude into the compiler... somehow.
-  std::string prelude("src/prelude.spl");
-  AST::File *file = parseFile(prelude);
+  // Owns the AST and its types, released in bulk on exit.
+  AST::Arena arena;
+
+  if (!CacheDir.empty())
+    Cache = new AST::CompileCache(CacheDir);
+
+  AST::File *file = parsePrelude();
   for (unsigned i=0, e=InputFilenames.size(); i != e; ++i)
     file->merge(*parseFile(InputFilenames[i]));
 
-  file->compile();
+  file->compile(Cache);
 
-  if (Optimize)
-    file->optimize();
+  unsigned level = SPL::getOptLevel(OptLevel);
+  if (level > 0) {
+    llvm::NamedRegionTimer timer("Optimize", AST::PhaseTimerGroup, TimePhases);
+    file->optimize(level, Jobs);
+  }
 
+  llvm::NamedRegionTimer emitTimer("Emit", AST::PhaseTimerGroup, TimePhases);
   std::string err;
-  llvm::raw_fd_ostream out(outFile.c_str(), err);
-  if (!err.empty()) {
-    std::cerr << "Unable to open output file: " << outFile << std::endl;
+  if (FileType == BitcodeFile) {
+    llvm::raw_fd_ostream out(outFile.c_str(), err);
+    if (!err.empty()) {
+      std::cerr << "Unable to open output file: " << outFile << std::endl;
+      exit(1);
+    }
+    llvm::WriteBitcodeToFile(&file->getModule(), out);
+    return 0;
+  }
+
+  // Native output goes through assembly, which cc assembles and links
+  // against the runtime (src/prelude.ll, src/runtime.cpp) and the collector.
+  std::string asmFile(FileType == AssemblyFile ? outFile : outFile + ".s");
+  if (!SPL::writeNativeAssembly(file->getModule(), asmFile, err)) {
+    std::cerr << "Unable to generate native code: " << err << std::endl;
+    exit(1);
+  }
+  if (FileType == AssemblyFile)
+    return 0;
+
+  std::vector<std::string> args;
+  if (FileType == ObjectFile)
+    args.push_back("-c");
+  args.push_back(asmFile);
+  if (FileType == ExecutableFile) {
+    args.push_back(RuntimeFilename);
+    args.push_back("-lgc");
+    args.push_back("-lstdc++");
+    args.push_back("-lpthread");
+  }
+  args.push_back("-o");
+  args.push_back(outFile);
+  bool built = SPL::runSystemCompiler(args, err);
+  std::remove(asmFile.c_str());
+  if (!built) {
+    std::cerr << "Unable to build " << outFile << ": " << err << std::endl;
     exit(1);
   }
-  llvm::WriteBitcodeToFile(&file->getModule(), out);
 
   return 0;
 }
@@ -0,0 +1,106 @@
+#include "ast.h"
+
+#include "llvm/Constants.h"
+#include "llvm/Instructions.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/InstIterator.h"
+
+using std::vector;
+using std::pair;
+using namespace llvm;
+
+namespace {
+
+// Constructor::Codegen() puts every structure that is not unboxed on
+// the GC heap, as are unboxed ones when they are stored away. Most of
+// them never leave the function that built them, so this replaces the
+// ones whose address provably stays local with entry block allocas,
+// which SROA can then break up into registers.
+//
+// Run after mem2reg, so that values bound with `val' are no longer
+// hidden behind the stores and loads of their Register allocas.
+class HeapToStack : public FunctionPass {
+public:
+  static char ID;
+  HeapToStack() : FunctionPass(ID) {}
+  virtual bool runOnFunction(Function &F);
+};
+
+char HeapToStack::ID = 0;
+
+bool isGCAlloc(CallInst *call) {
+  Function *callee = call->getCalledFunction();
+  if (callee == NULL)
+    return false;
+  return callee->getName() == "GC_malloc" ||
+    callee->getName() == "GC_malloc_atomic" ||
+    callee->getName() == "spl_alloc_profiled";
+}
+
+// Conservatively, does the address V (or one derived from it) escape?
+// Loading, storing through it and comparing it are the only safe uses.
+bool mayEscape(Value *V) {
+  for (Value::use_iterator ui=V->use_begin(), e=V->use_end(); ui != e; ++ui) {
+    User *user = *ui;
+    if (isa<LoadInst>(user) || isa<ICmpInst>(user))
+      continue;
+    if (StoreInst *store = dyn_cast<StoreInst>(user)) {
+      if (store->getOperand(0) == V)
+        return true; // The address itself is being stored somewhere.
+      continue;
+    }
+    if (isa<BitCastInst>(user) || isa<GetElementPtrInst>(user)) {
+      if (mayEscape(user))
+        return true;
+      continue;
+    }
+    // Calls, returns, PHIs, selects, etc.
+    return true;
+  }
+  return false;
+}
+
+bool HeapToStack::runOnFunction(Function &F) {
+  vector<pair<CallInst*, BitCastInst*> > local;
+  for (inst_iterator it = inst_begin(F), e = inst_end(F); it != e; ++it) {
+    CallInst *call = dyn_cast<CallInst>(&*it);
+    if (call == NULL || !isGCAlloc(call) || !call->hasOneUse())
+      continue;
+    BitCastInst *bitcast = dyn_cast<BitCastInst>(*call->use_begin());
+    if (bitcast == NULL)
+      continue;
+
+    // Only fixed size objects, i.e. structures, are allocated with
+    // exactly the size of the type they are cast to.
+    const Type *ty = bitcast->getType()->getContainedType(0);
+    if (call->getArgOperand(0) != ConstantExpr::getSizeOf(ty))
+      continue;
+    if (mayEscape(bitcast))
+      continue;
+    local.push_back(pair<CallInst*, BitCastInst*>(call, bitcast));
+  }
+
+  BasicBlock &entry = F.getEntryBlock();
+  for (unsigned i=0, e=local.size(); i != e; ++i) {
+    CallInst *call = local[i].first;
+    BitCastInst *bitcast = local[i].second;
+    const Type *ty = bitcast->getType()->getContainedType(0);
+
+    AllocaInst *alloca = new AllocaInst(ty, 0, "stackobj", entry.begin());
+    // GC_malloc hands out zeroed memory, keep that guarantee.
+    new StoreInst(Constant::getNullValue(ty), alloca, bitcast);
+    bitcast->replaceAllUsesWith(alloca);
+    bitcast->eraseFromParent();
+    call->eraseFromParent();
+  }
+
+  return !local.empty();
+}
+
+}
+
+namespace SPL { namespace AST {
+
+FunctionPass *createHeapToStackPass() { return new HeapToStack(); }
+
+}};
@@ -1,7 +1,7 @@
 %{
 #include "ast.h"
+#include <cstring>
 #include <iostream>
-#include <fstream>
 using namespace SPL;
 using namespace std;
 
@@ -13,6 +13,17 @@ std::vector<AST::Extern*>    externs;
 std::vector<AST::SType*>     types;
 std::vector<AST::Class*>     classes;
 std::vector<AST::Instance*>  instances;
+
+// A token's text, pointing into the input buffer or, for string literals
+// with escapes, into the arena. Copied out only when the AST keeps it.
+struct Token {
+  const char *Begin;
+  unsigned Length;
+  std::string str() const { return std::string(Begin, Length); }
+  bool is(const char *s) const {
+    return strncmp(Begin, s, Length) == 0 && s[Length] == '\0';
+  }
+};
 %}
 
 %locations
@@ -23,7 +34,7 @@ std::vector<AST::Instance*>  instances;
   AST::Func *fun;
   AST::Extern *ext;
   int value;
-  string *ident;
+  Token ident;
   vector<pair<string,AST::TypePlaceholder*> > *args;
   vector<AST::Expr*> *callargs;
   vector<AST::TypePlaceholder*> *types;
@@ -65,6 +76,9 @@ std::vector<AST::Instance*>  instances;
 %token IF
 %token ELSE
 %token WHILE
+%token FOR
+%token FOREACH
+%token UNTIL
 %token STRUCT
 %token UNION
 %token CLASS
@@ -96,9 +110,12 @@ exp : exp '+' exp { $$ = new AST::Add(*$1, *$3); }
     | exp '-' exp { $$ = new AST::Subtract(*$1, *$3); }
     | exp '*' exp { $$ = new AST::Multiply(*$1, *$3); }
     | exp '=' exp { $$ = new AST::Assign(*$1, *$3); }
-    | exp '.' IDENT { $$ = new AST::Member(*$1, *$3); }
+    | exp '.' IDENT { $$ = new AST::Member(*$1, $3.str()); }
     | exp EQ  exp { $$ = new AST::Eq(*$1, *$3); }
-    | exp PP  exp { $$ = new AST::JoinString(*$1, *$3); }
+    | exp PP  exp {
+      $$ = new AST::JoinString(*$1, *$3);
+      $$->setLocation(@2.first_line, @2.first_column);
+    }
     | '{' exps '}' {
       // Unroll the block into a classic ML expression.
       vector<AST::Expr*> exprs = *$2;
@@ -123,33 +140,44 @@ exp : exp '+' exp { $$ = new AST::Add(*$1, *$3); }
         $$ = last;
       }
     }
-    | IDENT       { $$ = new AST::Variable(*$1); }
+    | IDENT       { $$ = new AST::Variable($1.str()); }
     | NUMBER      { $$ = new AST::Number($1); }
-    | STRING      { $$ = new AST::StringLiteral(*$1); }
+    | STRING      { $$ = new AST::StringLiteral($1.str()); }
     | exp '[' exp ']' { $$ = new AST::ArrayAccess(*$1, *$3); }
     | IF '(' exp ')' exp ELSE exp  { $$ = new AST::If(*$3, *$5, *$7); }
-    | TK_VAL IDENT '=' exp { $$ = new AST::Binding(*$2, *$4, false); }
-    | TK_VAR IDENT '=' exp { $$ = new AST::Binding(*$2, *$4, true); }
-    | IDENT '(' callargs ')' { $$ = new AST::Call(*$1, *$3); }
+    | TK_VAL IDENT '=' exp { $$ = new AST::Binding($2.str(), *$4, false); }
+    | TK_VAR IDENT '=' exp { $$ = new AST::Binding($2.str(), *$4, true); }
+    | IDENT '(' callargs ')' {
+      $$ = new AST::Call($1.str(), *$3);
+      $$->setLocation(@1.first_line, @1.first_column);
+    }
     | TIDENT typeSet '(' callargs ')' {
       // TODO: do this yucky stuff somewhere else. give it a phase?
-      if (*$1 == "Array") {
+      if ($1.is("Array")) {
         assert($2->size() == 1);
         assert($4->size() == 2);
         $$ = new AST::Array(*(*$2)[0], *(*$4)[0], *(*$4)[1]);
       } else {
-        $$ = new AST::Constructor(*$1, *$2, *$4);
+        $$ = new AST::Constructor($1.str(), *$2, *$4);
       }
+      $$->setLocation(@1.first_line, @1.first_column);
     }
     | fun { $$ = $1; }
     | WHILE '(' exp ')' exp { $$ = new AST::While(*$3, *$5); }
+    | FOR '(' IDENT '<' '-' exp UNTIL exp ')' exp {
+      $$ = new AST::For($3.str(), *$6, *$8, *$10);
+    }
+    | FOREACH '(' IDENT '<' '-' exp ')' exp {
+      $$ = new AST::For($3.str(), *$6, *$8);
+    }
 
 exps  : { $$ = new vector<AST::Expr*>(); }
       | exps ';' exp { $$ = $1; $$->push_back($3); }
       | exp { $$ = new vector<AST::Expr*>(); $$->push_back($1); }
 
 fun : funDef IDENT templateSet '(' args ')' ':' type '=' exp {
-      $$ = new AST::Func(*$2, *$3, *$5, *$8, *$10, NULL, $1);
+      $$ = new AST::Func($2.str(), *$3, *$5, *$8, *$10, NULL, $1);
+      $$->setLocation(@2.first_line, @2.first_column);
     }
     /* TODO: when we have more than local type inference working, invoke.
     | funDef IDENT '(' args ')' '=' '{' exp '}' {
@@ -158,7 +186,10 @@ fun : funDef IDENT templateSet '(' args ')' ':' type '=' exp {
     */
 
 extern: EXTERN IDENT templateSet '(' types ')' ':' type {
-        $$ = new AST::Extern(*$2,*$3,*$5,*$8);
+        $$ = new AST::Extern($2.str(),*$3,*$5,*$8);
+      }
+      | EXTERN funDef IDENT templateSet '(' types ')' ':' type {
+        $$ = new AST::Extern($3.str(),*$4,*$6,*$9,$2);
       }
 
 funDef : DEF  { $$ = AST::Pure }
@@ -171,14 +202,14 @@ templateSet : { $$ = new vector<AST::TypePlaceholder*>(); }
 typeSet   : { $$ = new vector<AST::TypePlaceholder*>(); }
           | '[' types ']' { $$ = $2; }
 
-type : TIDENT '[' types ']' { $$ = new AST::TypePlaceholder(*$1, *$3); }
+type : TIDENT '[' types ']' { $$ = new AST::TypePlaceholder($1.str(), *$3); }
      | type '-' '>' type {
         vector<AST::TypePlaceholder*> pms;
         pms.push_back($1);
         pms.push_back($4);
         $$ = new AST::TypePlaceholder("Function", pms);
      }
-     | TIDENT { $$ = new AST::TypePlaceholder(*$1); }
+     | TIDENT { $$ = new AST::TypePlaceholder($1.str()); }
 
 types : { $$ = new vector<AST::TypePlaceholder*>(); }
       | type {
@@ -193,7 +224,7 @@ types : { $$ = new vector<AST::TypePlaceholder*>(); }
 args  : {$$ = new vector<pair<string, AST::TypePlaceholder*> >(); }
       | IDENT ':' type {
         $$ = new vector<pair<string, AST::TypePlaceholder*> >();
-        $$->push_back(pair<string, AST::TypePlaceholder*>(*$1, $3));
+        $$->push_back(pair<string, AST::TypePlaceholder*>($1.str(), $3));
       }
       /* TODO
       | IDENT {
@@ -202,7 +233,7 @@ args  : {$$ = new vector<pair<string, AST::TypePlaceholder*> >(); }
       }
       */
       | args ',' IDENT ':' type {
-        $1->push_back(pair<string, AST::TypePlaceholder*>(*$3, $5));
+        $1->push_back(pair<string, AST::TypePlaceholder*>($3.str(), $5));
         $$ = $1;
       }
       /* TODO
@@ -218,7 +249,7 @@ callargs
       | callargs ',' exp { $1->push_back($3); $$ = $1; }
 
 sstruct : STRUCT TIDENT '=' '{' args '}' {
-  $$ = new AST::SStructType(*$2, *$5);
+  $$ = new AST::SStructType($2.str(), *$5);
 }
 sunion  : UNION  TIDENT '=' '{' args '}' { $$ = NULL; /* TODO */ }
 
@@ -228,7 +259,9 @@ instance : INSTANCE IDENT { $$ = NULL; /* TODO */ }
 
 %%
 
-std::istream *codein;
+// The input, which the lexer walks without copying. Set by the driver.
+const char *CodeCur;
+const char *CodeEnd;
 int line;
 int col;
 
@@ -267,7 +300,9 @@ bool isaspecial(int ch) {
 }
 
 int codeinget() {
-  int next = codein->get();
+  if (CodeCur == CodeEnd)
+    return EOF;
+  int next = (unsigned char)*CodeCur++;
   if (next == '\n') {
     line++;
     col = 0;
@@ -277,6 +312,38 @@ int codeinget() {
   return next;
 }
 
+int codeinpeek() {
+  return CodeCur == CodeEnd ? EOF : (unsigned char)*CodeCur;
+}
+
+struct Keyword {
+  const char *Text;
+  int Token;
+};
+
+const Keyword Keywords[] = {
+  { "def", DEF },
+  { "io", IO },
+  { "imp", IMP },
+  { "extern", EXTERN },
+  { "var", TK_VAR },
+  { "val", TK_VAL },
+  { "if", IF },
+  { "else", ELSE },
+  { "while", WHILE },
+  { "for", FOR },
+  { "foreach", FOREACH },
+  { "until", UNTIL },
+  { "struct", STRUCT },
+  { "union", UNION },
+  { "class", CLASS },
+  { "instance", INSTANCE },
+  { "==", EQ },
+  { "=", '=' },
+  { "++", PP },
+  { "+", '+' },
+};
+
 int yylex() {
   int LastChar = codeinget();
 
@@ -287,55 +354,66 @@ int yylex() {
   yylloc.first_column = col;
 
   if (isdigit(LastChar)) {
-    std::string num;
-    num += LastChar;
-    while (isdigit(codein->peek()))
-      num += codeinget();
+    int NumVal = LastChar - '0';
+    while (isdigit(codeinpeek()))
+      NumVal = NumVal * 10 + (codeinget() - '0');
     yylloc.last_line = line;
     yylloc.last_column = col;
 
-    int NumVal;
-    SPL::Util::from_string<int>(NumVal, num, std::dec);
     yylval.value = NumVal;
     return NUMBER;
   }
 
   // Skip multi-line comments.
-  if (LastChar == '/' && codein->peek() == '*') {
+  if (LastChar == '/' && codeinpeek() == '*') {
     codeinget();
-    while (!(codeinget() == '*' && codein->peek() == '/')) {
-      ;
+    while (!(codeinget() == '*' && codeinpeek() == '/')) {
+      assert(CodeCur != CodeEnd); // Unexpected EOF: unterminated comment.
     }
     codeinget();
     return yylex();
   }
 
   // Skip single-line comments.
-  if (LastChar == '/' && codein->peek() == '/') {
+  if (LastChar == '/' && codeinpeek() == '/') {
     codeinget();
-    while (codeinget() != '\n') {
+    while (codeinget() != '\n' && CodeCur != CodeEnd) {
       ;
     }
     return yylex();
   }
 
-  // String literals.
+  // String literals. Without escapes the token is the buffer itself;
+  // otherwise the unescaped text goes to the arena.
   if (LastChar == '"') {
-    std::string *str = new std::string();
-    while ((LastChar = codeinget()) != '"') {
+    const char *begin = CodeCur;
+    while ((LastChar = codeinget()) != '"' && LastChar != '\\')
+      assert(LastChar != EOF); // Unexpected EOF: expected string literal terminator.
+    yylval.ident.Begin = begin;
+    yylval.ident.Length = CodeCur - begin - 1;
+    if (LastChar == '"')
+      return STRING;
+
+    std::string text(begin, yylval.ident.Length);
+    for (; LastChar != '"'; LastChar = codeinget()) {
       assert(LastChar != EOF); // Unexpected EOF: expected string literal terminator.
       if (LastChar == '\\') {
         switch (codeinget()) {
-          case 'n': *str += "\n"; break;
-          case 'r': *str += "\r"; break;
-          case 't': *str += "\t"; break;
-          case '"': *str += "\""; break;
+          case 'n': text += "\n"; break;
+          case 'r': text += "\r"; break;
+          case 't': text += "\t"; break;
+          case '"': text += "\""; break;
         }
       } else {
-        *str += LastChar;
+        text += LastChar;
       }
     }
-    yylval.ident = str;
+    AST::Arena *arena = AST::Arena::current();
+    char *str = arena ? static_cast<char*>(arena->Allocate(text.size()))
+                      : new char[text.size()];
+    memcpy(str, text.data(), text.size());
+    yylval.ident.Begin = str;
+    yylval.ident.Length = text.size();
     return STRING;
   }
 
@@ -346,34 +424,20 @@ int yylex() {
     return LastChar;
 
   // Collect until whitespace.
-  std::string StrVal = "";
-  StrVal += LastChar;
   // TODO: Support a+b as Plus('a', 'b'), not Name("a+b"). Same with '='.
-  while (!isspace(codein->peek()) && !isaspecial(codein->peek()))
-    StrVal += codeinget();
+  yylval.ident.Begin = CodeCur - 1;
+  while (codeinpeek() != EOF && !isspace(codeinpeek()) &&
+      !isaspecial(codeinpeek()))
+    codeinget();
+  yylval.ident.Length = CodeCur - yylval.ident.Begin;
   yylloc.last_line = line;
   yylloc.last_column = col;
 
-  if (StrVal == "def") return DEF;
-  if (StrVal == "io")  return IO;
-  if (StrVal == "imp") return IMP;
-  if (StrVal == "extern") return EXTERN;
-  if (StrVal == "var") return TK_VAR;
-  if (StrVal == "val") return TK_VAL;
-  if (StrVal == "if")   return IF;
-  if (StrVal == "else") return ELSE;
-  if (StrVal == "while") return WHILE;
-  if (StrVal == "struct") return STRUCT;
-  if (StrVal == "union") return UNION;
-  if (StrVal == "class") return CLASS;
-  if (StrVal == "instance") return INSTANCE;
-  if (StrVal == "==") return EQ;
-  if (StrVal == "=") return '=';
-  if (StrVal == "++") return PP;
-  if (StrVal == "+") return '+';
-
-  yylval.ident = new std::string(StrVal);
-  if (StrVal[0] >= 'A' && StrVal[0] <= 'Z')
+  for (unsigned i=0, e=sizeof(Keywords)/sizeof(Keywords[0]); i != e; ++i)
+    if (yylval.ident.is(Keywords[i].Text))
+      return Keywords[i].Token;
+
+  if (LastChar >= 'A' && LastChar <= 'Z')
     return TIDENT;
   else
     return IDENT;
@@ -1,19 +1,24 @@
+#define DEBUG_TYPE "spl"
 #include "ast.h"
+#include "llvm/ADT/Statistic.h"
 #include <iostream>
 
 using namespace std;
 
+STATISTIC(NumLifted, "Inner functions lambda lifted");
+
 namespace SPL { namespace AST {
 
-void File::LambdaLiftFuncs() {
+void File::LambdaLiftFuncs(unsigned first) {
   vector<Func*> newFuncs;
 
-  for (vector<Func*>::const_iterator it=Funcs.begin(); it!=Funcs.end(); it++)
-    (*it)->LambdaLift(newFuncs);
+  for (unsigned i=first, e=Funcs.size(); i != e; ++i)
+    Funcs[i]->LambdaLift(newFuncs);
 
   string num;
   num += newFuncs.size();
   DEBUG(dbgs() << "Lifted " << num << " functions.\n");
+  NumLifted += newFuncs.size();
   Funcs.insert(Funcs.end(), newFuncs.begin(), newFuncs.end());
 }
 
@@ -44,6 +49,17 @@ Expr* If::LambdaLift(vector<Func*> &newFuncs) {
   return this;
 }
 
+Expr* For::LambdaLift(vector<Func*> &newFuncs) {
+  if (From != NULL)
+    From = From->LambdaLift(newFuncs);
+  if (Until != NULL)
+    Until = Until->LambdaLift(newFuncs);
+  if (Over != NULL)
+    Over = Over->LambdaLift(newFuncs);
+  Body = Body->LambdaLift(newFuncs);
+  return this;
+}
+
 Expr* Call::LambdaLift(vector<Func*> &newFuncs) {
   for (int i=0; i < Args.size(); i++) {
     Args[i] = Args[i]->LambdaLift(newFuncs);
@@ -52,96 +68,124 @@ Expr* Call::LambdaLift(vector<Func*> &newFuncs) {
 }
 
 Expr* Func::LambdaLift(vector<Func*> &newFuncs) {
-  Body = Body->LambdaLift(newFuncs);
-
   if (Context == NULL) {
     // Top-level function.
+    Body = Body->LambdaLift(newFuncs);
     return this;
-  } else {
-    // Inner function definition. Lift and replace with closure.
-    set<string> newB(Args.begin(), Args.end());
-    set<string> *freeVars = FindFreeVars(&newB);
-    vector<string> newArgs(freeVars->begin(), freeVars->end());
-    newArgs.insert(newArgs.end(), Args.begin(), Args.end());
-    string newName("$FromInner$" + Name);
-
-    Body->LambdaLift(newFuncs);
-    Body->RewriteBinding(Name, newName);
-    Context->RewriteBinding(Name, newName);
-    Context->LambdaLift(newFuncs);
-    Func *newFunc = new Func(
-      newName, newArgs, ArgSTypeNames, RetSTypeName, *Body, NULL, Pureness);
-
-    vector<string> activationRecord;
-    set<string>::const_iterator it;
-    for (it=freeVars->begin(); it!=freeVars->end(); it++)
-      activationRecord.push_back(*it);
-    Closure *closure = new Closure(newName, activationRecord, newFunc);
-    newFuncs.push_back(newFunc);
-
-    Binding *b = new Binding(Name, *closure, false);
-    b->setBody(*Context);
-    return b;
   }
+
+  // Inner function definition. Lift and replace with closure. The free
+  // variables of the body become leading arguments without a type
+  // annotation, type inference of the enclosing function fills them in.
+  set<string> newB(Args.begin(), Args.end());
+  newB.insert(Name);
+  set<string> *freeVars = Body->FindFreeVars(&newB);
+  vector<string> activationRecord(freeVars->begin(), freeVars->end());
+  vector<string> newArgs(activationRecord);
+  newArgs.insert(newArgs.end(), Args.begin(), Args.end());
+  vector<TypePlaceholder*> newArgSTypeNames(activationRecord.size(), NULL);
+  newArgSTypeNames.insert(
+    newArgSTypeNames.end(), ArgSTypeNames.begin(), ArgSTypeNames.end());
+  string newName("$FromInner$" + Name);
+
+  // Keep the lifted function ahead of the functions lifted out of its
+  // body, so that it is type inferred before them.
+  unsigned pos = newFuncs.size();
+  Body = Body->LambdaLift(newFuncs);
+  Body->RewriteBinding(Name, newName, activationRecord);
+  Func *newFunc = new Func(
+    newName, newArgs, newArgSTypeNames, RetSTypeName, *Body, NULL, Pureness);
+  newFuncs.insert(newFuncs.begin() + pos, newFunc);
+
+  Closure *closure = new Closure(newName, activationRecord, newFunc);
+  closure->setLocation(getLine(), getCol());
+  Binding *b = new Binding(Name, *closure, false);
+  b->setBody(*Context->LambdaLift(newFuncs));
+  return b;
 }
 
 /////////////////////////////////////////////////////////////////////
 
-void Expr::RewriteBinding(string &OldName, string &NewName) {
+void Expr::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
 }
 
-void Variable::RewriteBinding(string &OldName, string &NewName) {
+void Variable::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
   if (Name == OldName)
     Name = NewName;
 }
 
-void UnaryOp::RewriteBinding(string &OldName, string &NewName) {
-  SubExpr->RewriteBinding(OldName, NewName);
+void UnaryOp::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  SubExpr->RewriteBinding(OldName, NewName, Captured);
 }
 
-void BinaryOp::RewriteBinding(string &OldName, string &NewName) {
-  LHS->RewriteBinding(OldName, NewName);
-  RHS->RewriteBinding(OldName, NewName);
+void BinaryOp::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  LHS->RewriteBinding(OldName, NewName, Captured);
+  RHS->RewriteBinding(OldName, NewName, Captured);
 }
 
-void Binding::RewriteBinding(string &OldName, string &NewName) {
-  Init->RewriteBinding(OldName, NewName);
+void Binding::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  Init->RewriteBinding(OldName, NewName, Captured);
   if (OldName != Name) {
     // Only rewrite if this Bind is not shadowing the definition.
-    Body->RewriteBinding(OldName, NewName);
+    Body->RewriteBinding(OldName, NewName, Captured);
   }
 }
 
-void If::RewriteBinding(string &OldName, string &NewName) {
-  Cond->RewriteBinding(OldName, NewName);
-  Then->RewriteBinding(OldName, NewName);
-  Else->RewriteBinding(OldName, NewName);
+void If::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  Cond->RewriteBinding(OldName, NewName, Captured);
+  Then->RewriteBinding(OldName, NewName, Captured);
+  Else->RewriteBinding(OldName, NewName, Captured);
+}
+
+void For::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  if (Over == NULL) {
+    From->RewriteBinding(OldName, NewName, Captured);
+    Until->RewriteBinding(OldName, NewName, Captured);
+  } else {
+    Over->RewriteBinding(OldName, NewName, Captured);
+  }
+  if (OldName != Name)
+    Body->RewriteBinding(OldName, NewName, Captured);
 }
 
-void Call::RewriteBinding(string &OldName, string &NewName) {
-  if (CalleeName == OldName)
+void Call::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
+  if (CalleeName == OldName) {
     CalleeName = NewName;
+    CapturedArgs = Captured;
+  }
   for (vector<Expr*>::const_iterator it=Args.begin(); it!=Args.end(); it++) {
-    (*it)->RewriteBinding(OldName, NewName);
+    (*it)->RewriteBinding(OldName, NewName, Captured);
   }
 }
 
-void Func::RewriteBinding(string &OldName, string &NewName) {
+void Func::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
   bool bindsOldName = Name == OldName;
   for (vector<string>::const_iterator it=Args.begin(); it!=Args.end(); it++) {
     if (*it == OldName)
       bindsOldName = true;
   }
   if (!bindsOldName) {
-    Body->RewriteBinding(OldName, NewName);
-    Context->RewriteBinding(OldName, NewName);
+    Body->RewriteBinding(OldName, NewName, Captured);
+    Context->RewriteBinding(OldName, NewName, Captured);
   }
 }
 
-void Closure::RewriteBinding(string &OldName, string &NewName) {
+void Closure::RewriteBinding(string &OldName, string &NewName,
+    const vector<string> &Captured) {
   if (FuncName == OldName)
     FuncName = NewName;
-  // TODO: go through ActivationRecord, replace any matching bindings.
+  for (unsigned i=0, e=ActivationRecordNames.size(); i != e; ++i)
+    if (ActivationRecordNames[i] == OldName)
+      ActivationRecordNames[i] = NewName;
 }
 
 
@@ -188,6 +232,23 @@ set<string> *If::FindFreeVars(set<string> *bindings) {
   return v1;
 }
 
+set<string> *For::FindFreeVars(set<string> *bindings) {
+  set<string> *v1;
+  if (Over == NULL) {
+    v1 = From->FindFreeVars(bindings);
+    set<string> *v2 = Until->FindFreeVars(bindings);
+    v1->insert(v2->begin(), v2->end());
+  } else {
+    v1 = Over->FindFreeVars(bindings);
+  }
+  set<string> *newB = new set<string>();
+  newB->insert(bindings->begin(), bindings->end());
+  newB->insert(Name);
+  set<string> *v3 = Body->FindFreeVars(newB);
+  v1->insert(v3->begin(), v3->end());
+  return v1;
+}
+
 set<string> *Call::FindFreeVars(set<string> *bindings) {
   set<string> *ret = new set<string>();
   for (vector<Expr*>::const_iterator it=Args.begin(); it!=Args.end(); it++) {
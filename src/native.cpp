@@ -0,0 +1,79 @@
+#include "native.h"
+
+#include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Host.h"
+#include "llvm/System/Program.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Target/TargetRegistry.h"
+#include "llvm/Target/TargetSelect.h"
+
+using namespace llvm;
+
+namespace SPL {
+
+bool writeNativeAssembly(
+    Module &M, const std::string &path, std::string &err, bool pic) {
+  static bool initialized = false;
+  if (!initialized) {
+    InitializeAllTargets();
+    InitializeAllAsmPrinters();
+    initialized = true;
+  }
+
+  // SPL loops by recursion; fastcc calls marked tail must not grow the stack.
+  GuaranteedTailCallOpt = true;
+
+  std::string triple = sys::getHostTriple();
+  M.setTargetTriple(triple);
+  const Target *target = TargetRegistry::lookupTarget(triple, err);
+  if (target == NULL)
+    return false;
+  TargetMachine::setRelocationModel(pic ? Reloc::PIC_ : Reloc::Default);
+  TargetMachine *machine = target->createTargetMachine(triple, "");
+
+  raw_fd_ostream out(path.c_str(), err);
+  if (!err.empty()) {
+    delete machine;
+    return false;
+  }
+  formatted_raw_ostream fout(out);
+
+  PassManager pm;
+  pm.add(new TargetData(*machine->getTargetData()));
+  if (machine->addPassesToEmitFile(
+        pm, fout, TargetMachine::CGFT_AssemblyFile, CodeGenOpt::Default)) {
+    err = "target " + triple + " cannot emit assembly";
+    delete machine;
+    return false;
+  }
+  pm.run(M);
+
+  delete machine;
+  return true;
+}
+
+bool runSystemCompiler(const std::vector<std::string> &args, std::string &err) {
+  sys::Path cc = sys::Program::FindProgramByName("cc");
+  if (cc.isEmpty()) {
+    err = "unable to find cc";
+    return false;
+  }
+
+  std::vector<const char*> argv;
+  argv.push_back(cc.c_str());
+  for (unsigned i=0, e=args.size(); i != e; ++i)
+    argv.push_back(args[i].c_str());
+  argv.push_back(NULL);
+
+  int status = sys::Program::ExecuteAndWait(cc, &argv[0], 0, 0, 0, 0, &err);
+  if (status != 0 && err.empty())
+    err = "cc failed";
+  return status == 0;
+}
+
+}
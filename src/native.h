@@ -0,0 +1,25 @@
+#ifndef SPL_NATIVE_H
+#define SPL_NATIVE_H
+
+#include <string>
+#include <vector>
+
+namespace llvm { class Module; }
+
+namespace SPL {
+
+  // Lowers the module for the host machine and writes it as assembly,
+  // position independent if `pic' is set. Registers the targets on first
+  // use. Returns false and sets `err' on failure.
+  bool writeNativeAssembly(
+    llvm::Module &M, const std::string &path, std::string &err,
+    bool pic = false);
+
+  // Runs the system C compiler (`cc' on the PATH) with the given
+  // arguments, to assemble and link what writeNativeAssembly produced.
+  bool runSystemCompiler(
+    const std::vector<std::string> &args, std::string &err);
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+#include "ast.h"
+
+#include "llvm/LLVMContext.h"
+#include "llvm/PassManager.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/ValueMap.h"
+#include "llvm/System/Threading.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+
+using std::vector;
+using std::string;
+using std::map;
+using namespace llvm;
+
+// Only the function pipeline runs in parallel, code generation stays
+// serial. Func::Gen rebinds the generic types of the shared AST for every
+// specialization, and emits through codegen.cpp's global Builder, module
+// and literal pool. Generating in parallel would first need all of that
+// threaded through as a context, including Bind, TypeInfer and the
+// specialization worklist, so it is left out. The function pipeline
+// dominates -O compile time anyway, and each pass only looks at one
+// function. LLVM contexts are not thread safe, so every partition
+// travels to its worker as bitcode and is parsed into a private context.
+
+namespace {
+
+struct Partition {
+  string Bitcode;   // The partition on the way in, the result on the way out.
+  string Error;
+  unsigned Size;    // Instructions owned by this partition.
+  unsigned Level;   // -O<level>.
+  Partition() : Size(0), Level(0) {}
+};
+
+void *optimizePartition(void *arg) {
+  Partition *part = static_cast<Partition*>(arg);
+  LLVMContext context;
+
+  MemoryBuffer *buf = MemoryBuffer::getMemBuffer(part->Bitcode, "partition");
+  Module *m = ParseBitcodeFile(buf, context, &part->Error);
+  delete buf;
+  if (m == 0)
+    return 0;
+
+  {
+    FunctionPassManager fpm(m);
+    SPL::AST::addFunctionPasses(fpm, part->Level);
+    fpm.doInitialization();
+    for (Module::iterator it = m->begin(), e = m->end(); it != e; ++it)
+      if (!it->isDeclaration())
+        fpm.run(*it);
+    fpm.doFinalization();
+  }
+
+  part->Bitcode.clear();
+  raw_string_ostream out(part->Bitcode);
+  WriteBitcodeToFile(m, out);
+  out.flush();
+  delete m;
+  return 0;
+}
+
+unsigned countInstructions(Function &fn) {
+  unsigned n = 0;
+  for (Function::iterator bb = fn.begin(), e = fn.end(); bb != e; ++bb)
+    n += bb->size();
+  return n;
+}
+
+// A module with the bodies of the given functions only. Everything else
+// is declared, and the globals are defined by the first partition alone.
+Module *extractPartition(
+    Module *M, const vector<Function*> &owned, bool defineGlobals) {
+  Module *part = new Module(M->getModuleIdentifier(), M->getContext());
+  part->setDataLayout(M->getDataLayout());
+  part->setTargetTriple(M->getTargetTriple());
+  ValueMap<const Value*, Value*> vmap;
+
+  for (Module::global_iterator it = M->global_begin(), e = M->global_end();
+      it != e; ++it) {
+    GlobalVariable *gv = new GlobalVariable(*part,
+      it->getType()->getElementType(), it->isConstant(),
+      GlobalValue::ExternalLinkage, 0, it->getName(), 0, it->isThreadLocal(),
+      it->getType()->getAddressSpace());
+    gv->copyAttributesFrom(&*it);
+    vmap[&*it] = gv;
+  }
+  for (Module::iterator it = M->begin(), e = M->end(); it != e; ++it) {
+    Function *fn = Function::Create(it->getFunctionType(),
+      GlobalValue::ExternalLinkage, it->getName(), part);
+    fn->copyAttributesFrom(&*it);
+    vmap[&*it] = fn;
+  }
+
+  for (Module::global_iterator it = M->global_begin(), e = M->global_end();
+      it != e; ++it) {
+    if (!defineGlobals || !it->hasInitializer())
+      continue;
+    GlobalVariable *gv = cast<GlobalVariable>(vmap[&*it]);
+    gv->setInitializer(
+      cast<Constant>(MapValue(it->getInitializer(), vmap, true)));
+    gv->setLinkage(it->getLinkage());
+  }
+
+  for (unsigned i=0, e=owned.size(); i != e; ++i) {
+    Function *fn = cast<Function>(vmap[owned[i]]);
+    Function::arg_iterator dst = fn->arg_begin();
+    for (Function::const_arg_iterator src = owned[i]->arg_begin(),
+        end = owned[i]->arg_end(); src != end; ++src, ++dst) {
+      dst->setName(src->getName());
+      vmap[&*src] = &*dst;
+    }
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(fn, owned[i], vmap, true, returns);
+    fn->setLinkage(owned[i]->getLinkage());
+  }
+  return part;
+}
+
+} // end anonymous namespace
+
+namespace SPL { namespace AST {
+
+Module *optimizeFunctionsInParallel(
+    Module *M, unsigned level, unsigned jobs) {
+  // A partition sees the other partitions' functions and, but for the
+  // first, the globals as declarations, so nothing may be local to the
+  // module while it is split up. Unnamed ones get a name to link by.
+  map<string,GlobalValue::LinkageTypes> local;
+  vector<GlobalValue*> values;
+  for (Module::global_iterator it = M->global_begin(), e = M->global_end();
+      it != e; ++it)
+    values.push_back(&*it);
+  vector<Function*> defs;
+  for (Module::iterator it = M->begin(), e = M->end(); it != e; ++it) {
+    values.push_back(&*it);
+    if (!it->isDeclaration())
+      defs.push_back(&*it);
+  }
+  for (unsigned i=0, e=values.size(); i != e; ++i) {
+    if (!values[i]->hasLocalLinkage())
+      continue;
+    if (!values[i]->hasName())
+      values[i]->setName("spl.partition.local");
+    local[values[i]->getName()] = values[i]->getLinkage();
+    values[i]->setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  if (jobs > defs.size())
+    jobs = defs.size();
+  if (jobs == 0)
+    jobs = 1;
+
+  // Hand each function, largest first, to the least loaded partition.
+  vector<Partition> parts(jobs);
+  vector<vector<Function*> > owned(jobs);
+  vector<std::pair<unsigned,Function*> > bySize;
+  for (unsigned i=0, e=defs.size(); i != e; ++i)
+    bySize.push_back(std::make_pair(countInstructions(*defs[i]), defs[i]));
+  std::sort(bySize.rbegin(), bySize.rend());
+  for (unsigned i=0, e=bySize.size(); i != e; ++i) {
+    unsigned least = 0;
+    for (unsigned j=1; j != jobs; ++j)
+      if (parts[j].Size < parts[least].Size)
+        least = j;
+    parts[least].Size += bySize[i].first;
+    owned[least].push_back(bySize[i].second);
+  }
+
+  for (unsigned i=0; i != jobs; ++i) {
+    parts[i].Level = level;
+    Module *part = extractPartition(M, owned[i], i == 0);
+    raw_string_ostream out(parts[i].Bitcode);
+    WriteBitcodeToFile(part, out);
+    out.flush();
+    delete part;
+  }
+
+  llvm_start_multithreaded();
+  vector<pthread_t> threads(jobs);
+  for (unsigned i=0; i != jobs; ++i)
+    if (pthread_create(&threads[i], 0, optimizePartition, &parts[i])) {
+      std::cerr << "Unable to start optimization thread" << std::endl;
+      exit(1);
+    }
+  for (unsigned i=0; i != jobs; ++i)
+    pthread_join(threads[i], 0);
+
+  Module *result = 0;
+  for (unsigned i=0; i != jobs; ++i) {
+    Module *m = 0;
+    if (parts[i].Error.empty()) {
+      MemoryBuffer *buf =
+        MemoryBuffer::getMemBuffer(parts[i].Bitcode, "partition");
+      m = ParseBitcodeFile(buf, getGlobalContext(), &parts[i].Error);
+      delete buf;
+    }
+    if (m == 0) {
+      std::cerr << "Error optimizing partition " << i << ": "
+                << parts[i].Error << std::endl;
+      exit(1);
+    }
+
+    if (result == 0) {
+      result = m;
+      continue;
+    }
+    string err;
+    if (Linker::LinkModules(result, m, &err)) {
+      std::cerr << "Error linking partition " << i << ": " << err
+                << std::endl;
+      exit(1);
+    }
+    delete m;
+  }
+
+  for (map<string,GlobalValue::LinkageTypes>::iterator it = local.begin();
+      it != local.end(); ++it)
+    if (GlobalValue *gv = result->getNamedValue(it->first))
+      gv->setLinkage(it->second);
+
+  result->setModuleIdentifier(M->getModuleIdentifier());
+  return result;
+}
+
+}}
@@ -0,0 +1,39 @@
+#include "pipeline.h"
+
+#include "llvm/PassManager.h"
+#include "llvm/Support/StandardPasses.h"
+#include "llvm/Transforms/IPO.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace llvm;
+
+namespace SPL {
+
+void addStandardFunctionPasses(FunctionPassManager &fpm, unsigned level) {
+  if (level > 0)
+    createStandardFunctionPasses(&fpm, level);
+}
+
+void addStandardModulePasses(PassManager &pm, unsigned level) {
+  if (level == 0)
+    return;
+  Pass *inliner = level > 1
+    ? createFunctionInliningPass(level > 2 ? 275 : 225)
+    : createAlwaysInlinerPass();
+  // Unit at a time: the interprocedural passes, FunctionAttrs among them,
+  // which turns def functions that only compute into readnone ones.
+  createStandardModulePasses(
+    &pm, level, false, true, level > 1, true, false, inliner);
+}
+
+unsigned getOptLevel(char arg) {
+  if (arg < '0' || arg > '3') {
+    std::cerr << "Invalid optimization level: -O" << arg << std::endl;
+    exit(1);
+  }
+  return arg - '0';
+}
+
+}
@@ -0,0 +1,22 @@
+#ifndef SPL_PIPELINE_H
+#define SPL_PIPELINE_H
+
+namespace llvm {
+  class FunctionPassManager;
+  class PassManager;
+}
+
+namespace SPL {
+
+  // The standard LLVM pipelines at -O<level>, shared by splc and splvm.
+  // Level 0 adds nothing. The module passes always-inline at 1 and run
+  // the inliner from 2 on, with a higher threshold at 3.
+  void addStandardFunctionPasses(llvm::FunctionPassManager &, unsigned level);
+  void addStandardModulePasses(llvm::PassManager &, unsigned level);
+
+  // Checks the argument of -O, exiting on anything but 0-3.
+  unsigned getOptLevel(char arg);
+
+}
+
+#endif
@@ -1,22 +1,10 @@
-%string = type { i32, [0 x i8]* }
-%array = type { i32, [0 x i8*]* }
-
-declare i32 @printf(i8*, ...)
-declare i32 @putchar(i32)
+%string = type { i32, [0 x i8] }
+%array = type { i32, [0 x i8*] }
 
 define i8* @c_str(%string* %sprintString) {
 entry:
-  %x1 = getelementptr inbounds %string* %sprintString, i32 0, i32 1
-  %x2 = load [0 x i8]** %x1
-  %x3 = getelementptr inbounds [0 x i8]* %x2, i32 0, i32 0
-  ret i8* %x3
-}
-
-define i32 @print(%string* %x1) {
-entry:
-  %x2 = call i8* (%string*)* @c_str(%string* %x1)
-  %calltmp = call i32 (i8*, ...)* @printf(i8* %x2)
-  ret i32 %calltmp
+  %x1 = getelementptr inbounds %string* %sprintString, i32 0, i32 1, i32 0
+  ret i8* %x1
 }
 
 define i32 @length(%array* %x1) {
@@ -0,0 +1,347 @@
+// splrepl: a compile server. It reads definitions and expressions from
+// stdin and keeps the prelude, the types, the module and the JIT alive
+// in between, so that each input only costs compiling what it adds.
+//
+//   spl> def sq(x: Int32): Int32 = x * x
+//   spl> sq(7) + 1
+//   50
+//
+// An expression is compiled as the body of a fresh io function and run
+// at once; when it is an Int32 its value is printed. Definitions are
+// added for good: a name cannot be defined again, and as each expression
+// is a function of its own, there are no top-level vals or vars.
+#include "ast.h"
+#include "pipeline.h"
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/IRBuilder.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/System/Host.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Target/TargetSelect.h"
+
+using namespace SPL;
+using namespace llvm;
+
+extern int yyparse();
+extern const char *CodeCur;
+extern const char *CodeEnd;
+extern std::vector<AST::Func*>      toplevel;
+extern std::vector<AST::Extern*>    externs;
+extern std::vector<AST::SType*>     types;
+extern int line;
+extern int col;
+
+// src/prelude.spl, embedded by the build (build/prelude_spl.cpp).
+extern const char PreludeSource[];
+
+cl::opt<char> OptLevel(
+  "O", cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default -O0)"),
+  cl::Prefix, cl::ZeroOrMore, cl::init('0'));
+
+// The runtime: prelude.ll and runtime.cpp.
+extern "C" int32_t print(void *);
+extern "C" int32_t printChar(int32_t);
+extern "C" int32_t printAll(void *);
+extern "C" int32_t flush();
+extern "C" int32_t length(void *);
+extern "C" void *spl_alloc_profiled(int64_t, int32_t, const char *);
+extern "C" int32_t spl_par_chunks(int32_t);
+extern "C" void spl_par_run(int32_t, int32_t, void *, void *);
+
+static const struct {
+  const char *Name;
+  void *Address;
+} RuntimeFuncs[] = {
+  { "print", (void*)(intptr_t)print },
+  { "printChar", (void*)(intptr_t)printChar },
+  { "printAll", (void*)(intptr_t)printAll },
+  { "flush", (void*)(intptr_t)flush },
+  { "length", (void*)(intptr_t)length },
+  { "spl_alloc_profiled", (void*)(intptr_t)spl_alloc_profiled },
+  { "spl_par_chunks", (void*)(intptr_t)spl_par_chunks },
+  { "spl_par_run", (void*)(intptr_t)spl_par_run },
+};
+
+static void *findRuntimeFunc(const std::string &name) {
+  for (unsigned i=0, e=sizeof(RuntimeFuncs)/sizeof(RuntimeFuncs[0]); i != e; ++i)
+    if (name == RuntimeFuncs[i].Name)
+      return RuntimeFuncs[i].Address;
+  return NULL;
+}
+
+static AST::File *parseText(const std::string &text, std::string name,
+                            bool isExpr = false) {
+  MemoryBuffer *buf = MemoryBuffer::getMemBuffer(text, name);
+  CodeCur = buf->getBufferStart();
+  CodeEnd = buf->getBufferEnd();
+  line = 1;
+  col = 0;
+
+  int ret = yyparse();
+  delete buf;
+  if (ret) {
+    std::cerr << "Error parsing: " << ret << std::endl;
+    exit(1);
+  }
+  if (isExpr)
+    toplevel.back()->setReturnInferred();
+
+  AST::File *file = new AST::File(name, toplevel, externs, types);
+  toplevel.clear();
+  externs.clear();
+  types.clear();
+  return file;
+}
+
+#ifndef PR_SET_CHILD_SUBREAPER
+#define PR_SET_CHILD_SUBREAPER 36
+#endif
+
+// The compiler reports errors by exiting. So that a mistake does not end
+// the session, each input is compiled and run with a copy of the server
+// standing by, forked just before: when the server exits instead, the
+// copy, which has the state from before the input, carries on in its
+// place. The first process stays behind as the parent that the copies
+// are handed to, so that the shell waits for the session as a whole.
+static bool Supervised = false;
+
+static void superviseSession() {
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) != 0)
+    return; // Without it, errors end the session.
+  pid_t pid = fork();
+  if (pid < 0)
+    return;
+  if (pid == 0) {
+    Supervised = true;
+    return;
+  }
+  int status;
+  while (wait(&status) > 0 || errno == EINTR)
+    ;
+  exit(0);
+}
+
+// Returns in the server, with the pipe to release the copy through, and
+// in the copy only once the server has exited without releasing it.
+static int standBy() {
+  if (!Supervised)
+    return -1;
+  // The copy must not write out again what the server has buffered.
+  flush();
+  std::cout.flush();
+  std::cerr.flush();
+  int fds[2];
+  if (pipe(fds) < 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid != 0) {
+    close(fds[0]);
+    if (pid > 0)
+      return fds[1];
+    close(fds[1]);
+    return -1;
+  }
+  close(fds[1]);
+  char released;
+  ssize_t n;
+  while ((n = read(fds[0], &released, 1)) < 0 && errno == EINTR)
+    ;
+  if (n == 1)
+    _exit(0);
+  close(fds[0]);
+  return -1;
+}
+
+static void release(int standby) {
+  if (standby < 0)
+    return;
+  char released = 1;
+  while (write(standby, &released, 1) < 0 && errno == EINTR)
+    ;
+  close(standby);
+}
+
+// Reads one input, which goes on over as many lines as it takes for its
+// brackets to balance.
+static bool readInput(std::string &input) {
+  bool tty = isatty(0);
+  int depth = 0;
+  input.clear();
+  do {
+    if (tty)
+      std::cout << (input.empty() ? "spl> " : "...> ") << std::flush;
+    std::string text;
+    if (!std::getline(std::cin, text))
+      return !input.empty();
+    if (input.empty() && text.find_first_not_of(" \t") == std::string::npos)
+      continue;
+    for (unsigned i=0, e=text.size(); i != e; ++i) {
+      if (text[i] == '(' || text[i] == '{' || text[i] == '[')
+        ++depth;
+      else if (text[i] == ')' || text[i] == '}' || text[i] == ']')
+        --depth;
+    }
+    input += text;
+    input += '\n';
+  } while (input.empty() || depth > 0);
+  return true;
+}
+
+enum InputKind { Definition, Expression, TopLevelBinding };
+
+static InputKind getInputKind(const std::string &input) {
+  static const char *Keywords[] = { "def", "io", "imp", "struct", "extern" };
+  size_t begin = input.find_first_not_of(" \t\n");
+  size_t end = input.find_first_of(" \t\n(<", begin);
+  std::string word(input, begin, end - begin);
+  if (word == "val" || word == "var")
+    return TopLevelBinding;
+  for (unsigned i=0, e=sizeof(Keywords)/sizeof(Keywords[0]); i != e; ++i)
+    if (word == Keywords[i])
+      return Definition;
+  return Expression;
+}
+
+// Called from C: runs an expression's function, returning its value when
+// that is an Int32 and 0 otherwise.
+static Function *createRunner(Module *module, Function *fn) {
+  LLVMContext &ctx = module->getContext();
+  const Type *i32 = Type::getInt32Ty(ctx);
+  Function *run = Function::Create(FunctionType::get(i32, false),
+    Function::ExternalLinkage, fn->getName() + "$run", module);
+  IRBuilder<> b(BasicBlock::Create(ctx, "entry", run));
+  CallInst *call = b.CreateCall(fn);
+  call->setCallingConv(fn->getCallingConv());
+  b.CreateRet(fn->getReturnType() == i32 ? (Value*)call
+                                         : ConstantInt::get(i32, 0));
+  return run;
+}
+
+int main(int argc, char **argv) {
+  llvm_shutdown_obj shutdown;
+  cl::ParseCommandLineOptions(argc, argv, "SPL compile server");
+  unsigned level = SPL::getOptLevel(OptLevel);
+  superviseSession();
+
+  // Owns the AST and its types for as long as the server runs.
+  AST::Arena arena;
+
+  std::string preludeName("<prelude>");
+  AST::File *program = parseText(PreludeSource, preludeName);
+  std::vector<std::string> names;
+  program->getDefinedNames(names);
+  std::set<std::string> defined(names.begin(), names.end());
+  program->compile();
+  Module *module = &program->getModule();
+
+  // SPL loops by recursion; fastcc calls marked tail must not grow the stack.
+  GuaranteedTailCallOpt = true;
+
+  InitializeNativeTarget();
+  static const CodeGenOpt::Level codeGenLevels[] = {
+    CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default,
+    CodeGenOpt::Aggressive
+  };
+  std::string err;
+  ExecutionEngine *engine = EngineBuilder(module)
+    .setErrorStr(&err)
+    .setOptLevel(codeGenLevels[level])
+    .setMCPU(sys::getHostCPUName())
+    .create();
+  if (!engine) {
+    std::cerr << "ExecutionEngine: " << err << std::endl;
+    exit(1);
+  }
+  engine->InstallLazyFunctionCreator(findRuntimeFunc);
+  // Parallel loops run code on threads that must not call into the JIT.
+  engine->DisableLazyCompilation(true);
+
+  FunctionPassManager fpm(module);
+  fpm.add(new TargetData(*engine->getTargetData()));
+  if (level > 0)
+    AST::addFunctionPasses(fpm, level);
+  fpm.doInitialization();
+  std::set<Function*> optimized;
+
+  unsigned numExprs = 0;
+  std::string input;
+  while (readInput(input)) {
+    if (input == ":quit\n")
+      break;
+
+    InputKind kind = getInputKind(input);
+    if (kind == TopLevelBinding) {
+      std::cerr << "Top-level val and var are not supported, define a "
+                   "function instead" << std::endl;
+      continue;
+    }
+    // Expressions become `io repl$N()', returning whatever type they are
+    // of: the parser is told to drop the Int32 written down for it.
+    std::string name("<input>"), text(input);
+    if (kind == Expression) {
+      std::ostringstream os;
+      os << "repl$" << ++numExprs;
+      name = os.str();
+      text = "io " + name + "(): Int32 = {\n" + input + "}\n";
+    }
+
+    int standby = standBy();
+    AST::File *file = parseText(text, name, kind == Expression);
+    names.clear();
+    file->getDefinedNames(names);
+    bool redefines = false;
+    for (unsigned i=0, e=names.size(); i != e; ++i) {
+      if (defined.count(names[i])) {
+        std::cerr << "`" << names[i] << "' is already defined, and cannot "
+                     "be redefined" << std::endl;
+        redefines = true;
+      }
+    }
+    if (redefines) {
+      release(standby);
+      continue;
+    }
+    defined.insert(names.begin(), names.end());
+    program->merge(*file);
+    program->compile();
+
+    Function *run = NULL;
+    if (kind == Expression)
+      run = createRunner(module, module->getFunction(name));
+    for (Module::iterator f = module->begin(); f != module->end(); ++f)
+      if (!f->isDeclaration() && optimized.insert(&*f).second)
+        fpm.run(*f);
+
+    if (run != NULL) {
+      bool printsValue =
+        module->getFunction(name)->getReturnType()->isIntegerTy(32);
+      int32_t (*code)() =
+        (int32_t (*)())(intptr_t)engine->getPointerToFunction(run);
+      int32_t result = code();
+      flush();
+      if (printsValue)
+        std::cout << result << std::endl;
+    }
+    release(standby);
+  }
+
+  fpm.doFinalization();
+  return 0;
+}
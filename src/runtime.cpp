@@ -0,0 +1,314 @@
+// Runtime support for generated code that is easier to write in C++ than
+// in prelude.ll. Linked into splvm and, through libsplrt.a, into native
+// executables.
+
+// Worker threads are created through the collector, which registers
+// them and gives each its own allocation buffers.
+#define GC_THREADS
+#include <gc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace {
+
+// Allocations made by code compiled with -profile-allocs, per site. Sites
+// are the constant strings codegen emits, so they compare by address.
+struct SiteStats {
+  const char *Site;
+  uint64_t Count, Bytes;
+};
+
+std::map<const char*, SiteStats> *Sites;
+pthread_mutex_t SitesLock = PTHREAD_MUTEX_INITIALIZER;
+
+bool moreBytes(const SiteStats &a, const SiteStats &b) {
+  return a.Bytes > b.Bytes;
+}
+
+void reportAllocs() {
+  std::vector<SiteStats> sites;
+  for (std::map<const char*, SiteStats>::iterator it = Sites->begin();
+      it != Sites->end(); ++it)
+    sites.push_back(it->second);
+  std::sort(sites.begin(), sites.end(), moreBytes);
+
+  fprintf(stderr, "%14s %12s  %s\n", "bytes", "count", "allocation site");
+  for (unsigned i=0, e=sites.size(); i != e; ++i)
+    fprintf(stderr, "%14llu %12llu  %s\n",
+      (unsigned long long)sites[i].Bytes, (unsigned long long)sites[i].Count,
+      sites[i].Site);
+  fprintf(stderr, "GC: heap %lu bytes, %lu bytes allocated, %lu collections\n",
+    (unsigned long)GC_get_heap_size(), (unsigned long)GC_get_total_bytes(),
+    (unsigned long)GC_gc_no);
+}
+
+} // end anonymous namespace
+
+extern "C" void *spl_alloc_profiled(
+    int64_t bytes, int32_t pointerFree, const char *site) {
+  pthread_mutex_lock(&SitesLock);
+  if (Sites == NULL) {
+    Sites = new std::map<const char*, SiteStats>();
+    atexit(reportAllocs);
+  }
+  SiteStats &stats = (*Sites)[site];
+  stats.Site = site;
+  stats.Count++;
+  stats.Bytes += bytes;
+  pthread_mutex_unlock(&SitesLock);
+
+  return pointerFree ? GC_malloc_atomic(bytes) : GC_malloc(bytes);
+}
+
+// The data parallel primitives (parMap, parFor, parReduce). Generated code
+// cuts the work into chunks and hands spl_par_run a C function that does
+// one chunk. The calling thread and a pool of workers, started on first
+// use, take chunks off a shared counter until there are none left. The
+// chunks of one loop cost about the same, so taking the next free one
+// balances as well as stealing would.
+namespace {
+
+typedef void (*ChunkFn)(void *ctx, int32_t chunk, int32_t begin, int32_t end);
+
+struct ParJob {
+  ChunkFn Body;
+  void *Ctx;
+  int32_t N, Chunks;
+  volatile int32_t Next;    // The next chunk to run.
+  volatile int32_t Pending; // Chunks not yet finished.
+  unsigned Workers;         // Workers still looking at the job.
+};
+
+pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t PoolWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t PoolDone = PTHREAD_COND_INITIALIZER;
+ParJob *CurrentJob;
+unsigned Generation; // Bumped for every job, so workers see each once.
+unsigned NumWorkers;
+bool PoolStarted;
+__thread bool InParallel;
+
+unsigned getNumThreads() {
+  if (const char *env = getenv("SPL_THREADS"))
+    if (int n = atoi(env))
+      return n > 0 ? n : 1;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+void runChunks(ParJob *job) {
+  bool outer = InParallel;
+  InParallel = true;
+  int32_t chunk;
+  while ((chunk = __sync_fetch_and_add(&job->Next, 1)) < job->Chunks) {
+    int64_t begin = (int64_t)job->N * chunk / job->Chunks;
+    int64_t end = (int64_t)job->N * (chunk + 1) / job->Chunks;
+    job->Body(job->Ctx, chunk, begin, end);
+    if (__sync_sub_and_fetch(&job->Pending, 1) == 0) {
+      pthread_mutex_lock(&PoolLock);
+      pthread_cond_broadcast(&PoolDone);
+      pthread_mutex_unlock(&PoolLock);
+    }
+  }
+  InParallel = outer;
+}
+
+void *workerMain(void *) {
+  unsigned seen = 0;
+  pthread_mutex_lock(&PoolLock);
+  for (;;) {
+    while (Generation == seen)
+      pthread_cond_wait(&PoolWork, &PoolLock);
+    seen = Generation;
+    ParJob *job = CurrentJob;
+    if (job == NULL)
+      continue;
+    job->Workers++;
+    pthread_mutex_unlock(&PoolLock);
+    runChunks(job);
+    pthread_mutex_lock(&PoolLock);
+    if (--job->Workers == 0)
+      pthread_cond_broadcast(&PoolDone);
+  }
+  return NULL;
+}
+
+// A forked child, such as the REPL's standby copy, has none of the
+// workers, so it starts a pool of its own when it needs one.
+void forgetPool() {
+  pthread_mutex_init(&PoolLock, NULL);
+  pthread_cond_init(&PoolWork, NULL);
+  pthread_cond_init(&PoolDone, NULL);
+  CurrentJob = NULL;
+  NumWorkers = 0;
+  PoolStarted = false;
+}
+
+void startPool() {
+  static bool registered = false;
+  if (!registered)
+    pthread_atfork(NULL, NULL, forgetPool);
+  registered = true;
+  NumWorkers = getNumThreads() - 1;
+  for (unsigned i=0; i != NumWorkers; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerMain, NULL)) {
+      NumWorkers = i;
+      break;
+    }
+    pthread_detach(thread);
+  }
+  PoolStarted = true;
+}
+
+} // end anonymous namespace
+
+// How many chunks to cut n iterations into: a few per thread, so that a
+// slow chunk does not hold up the others, but never an empty one.
+extern "C" int32_t spl_par_chunks(int32_t n) {
+  int32_t chunks = 4 * getNumThreads();
+  return n < chunks ? n : chunks;
+}
+
+extern "C" void spl_par_run(
+    int32_t n, int32_t chunks, ChunkFn body, void *ctx) {
+  ParJob job;
+  job.Body = body;
+  job.Ctx = ctx;
+  job.N = n;
+  job.Chunks = chunks;
+  job.Next = 0;
+  job.Pending = chunks;
+  job.Workers = 0;
+  if (chunks <= 0)
+    return;
+
+  // Nested loops, and loops started while the pool is busy, run on the
+  // calling thread alone.
+  pthread_mutex_lock(&PoolLock);
+  if (InParallel || CurrentJob != NULL) {
+    pthread_mutex_unlock(&PoolLock);
+    runChunks(&job);
+    return;
+  }
+  if (!PoolStarted)
+    startPool();
+  CurrentJob = &job;
+  Generation++;
+  pthread_cond_broadcast(&PoolWork);
+  pthread_mutex_unlock(&PoolLock);
+
+  runChunks(&job);
+
+  // The job lives on this stack, so wait for the workers to let go too.
+  pthread_mutex_lock(&PoolLock);
+  while (job.Pending != 0 || job.Workers != 0)
+    pthread_cond_wait(&PoolDone, &PoolLock);
+  CurrentJob = NULL;
+  pthread_mutex_unlock(&PoolLock);
+}
+
+// Program output. Everything written to stdout by SPL goes through one
+// buffer, written out with write(2) when full, on flush() and at exit.
+// Strings carry their length, so nothing is scanned or formatted.
+namespace {
+
+struct SplString {
+  int32_t Length;
+  char Data[1];
+};
+
+struct SplStringArray {
+  int32_t Length;
+  SplString *Data[1];
+};
+
+const size_t OutSize = 1 << 16;
+char OutBuf[OutSize];
+size_t OutLen;
+bool OutAtExit;
+// Only io code prints, but it can be reached through function values
+// from parallel loops.
+pthread_mutex_t OutLock = PTHREAD_MUTEX_INITIALIZER;
+
+void writeAll(const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(1, data, len);
+    if (n < 0)
+      return; // Nowhere to report it, stdout is gone.
+    data += n;
+    len -= n;
+  }
+}
+
+void flushOut() {
+  writeAll(OutBuf, OutLen);
+  OutLen = 0;
+}
+
+void flushAtExit() {
+  pthread_mutex_lock(&OutLock);
+  flushOut();
+  pthread_mutex_unlock(&OutLock);
+}
+
+// With OutLock held.
+void putBytes(const char *data, size_t len) {
+  if (!OutAtExit) {
+    atexit(flushAtExit);
+    OutAtExit = true;
+  }
+  if (OutLen + len > OutSize) {
+    flushOut();
+    // Too large to be worth copying.
+    if (len >= OutSize) {
+      writeAll(data, len);
+      return;
+    }
+  }
+  memcpy(OutBuf + OutLen, data, len);
+  OutLen += len;
+}
+
+} // end anonymous namespace
+
+extern "C" int32_t print(SplString *str) {
+  pthread_mutex_lock(&OutLock);
+  putBytes(str->Data, str->Length);
+  pthread_mutex_unlock(&OutLock);
+  return str->Length;
+}
+
+extern "C" int32_t printChar(int32_t c) {
+  char byte = c;
+  pthread_mutex_lock(&OutLock);
+  putBytes(&byte, 1);
+  pthread_mutex_unlock(&OutLock);
+  return c;
+}
+
+// Every string of the array under a single lock.
+extern "C" int32_t printAll(SplStringArray *strs) {
+  int32_t total = 0;
+  pthread_mutex_lock(&OutLock);
+  for (int32_t i=0; i != strs->Length; ++i) {
+    putBytes(strs->Data[i]->Data, strs->Data[i]->Length);
+    total += strs->Data[i]->Length;
+  }
+  pthread_mutex_unlock(&OutLock);
+  return total;
+}
+
+extern "C" int32_t flush() {
+  pthread_mutex_lock(&OutLock);
+  flushOut();
+  pthread_mutex_unlock(&OutLock);
+  return 0;
+}
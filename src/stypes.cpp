@@ -94,6 +94,21 @@ void SStructType::Bind(
   ThisType = StructType::get(getGlobalContext(), tys);
 }
 Type const *SStructType::getPassType() { return ThisType; }
+// As many fields as fit in a pair of registers.
+bool SStructType::isUnboxed() {
+  PassingFixed = true;
+  return !Mutated && ElementSTypes.size() <= 2;
+}
+// Only a later compile of the same File, see File::compile, can find an
+// assignment after the question has been answered.
+void SStructType::setMutated() {
+  if (PassingFixed && !Mutated && isUnboxed()) {
+    std::cerr << "Cannot assign to fields of `" << Name
+      << "', it is already compiled as a value" << std::endl;
+    exit(1);
+  }
+  Mutated = true;
+}
 Type const *SStructType::getType() { return PointerType::getUnqual(ThisType); }
 void SArray::Bind(vector<string> &, map<string, SType*> &) {
   SType *ty = Contained;
@@ -110,19 +125,21 @@ void SArray::Bind(vector<string> &, map<string, SType*> &) {
 
   vector<const Type *> tys;
   tys.push_back(Type::getInt32Ty(getGlobalContext()));
-  tys.push_back(PointerType::getUnqual(ArrayType::get(ty->getType(), 0)));
+  tys.push_back(ArrayType::get(ty->getType(), 0));
   ThisType = StructType::get(getGlobalContext(), tys);
 }
 SType* SArray::ParamRebind(vector<SType*> &prms) {
   assert(prms.size() == 1);
-  SArray *sty = new SArray(prms[0]);
-  vector<string> x1;
-  sty->Bind(x1, NamedTypes);
-  return sty;
+  return SArray::get(prms[0]);
 }
 
+// Function values are closures, a pointer to an object whose first field
+// is the code. The code takes the object itself as a leading environment
+// pointer, any captured variables are stored after the code pointer.
 Type const *SFunctionType::getType() {
-  return PointerType::getUnqual(getFunctionType());
+  vector<const Type*> fields(1,
+    PointerType::getUnqual(getClosureFunctionType()));
+  return PointerType::getUnqual(StructType::get(getGlobalContext(), fields));
 }
 FunctionType const *SFunctionType::getFunctionType() {
   vector<const Type*> ArgTypes;
@@ -130,15 +147,17 @@ FunctionType const *SFunctionType::getFunctionType() {
     ArgTypes.push_back((*i)->getType());
   return FunctionType::get(Ret->getType(), ArgTypes, false);
 }
+FunctionType const *SFunctionType::getClosureFunctionType() {
+  vector<const Type*> ArgTypes(1, Type::getInt8PtrTy(getGlobalContext()));
+  for (vector<SType*>::const_iterator i=Args.begin(); i!=Args.end(); i++)
+    ArgTypes.push_back((*i)->getType());
+  return FunctionType::get(Ret->getType(), ArgTypes, false);
+}
 SType* SFunctionType::ParamRebind(vector<SType*> &prms) {
   assert(prms.size() >= 2);
   vector<SType*> args(prms.begin(), prms.end() - 1);
   SType* ret = prms[prms.size() - 1];
-  string name("Function");
-  SFunctionType *sty = new SFunctionType(name, args, ret);
-  vector<string> x1;
-  sty->Bind(x1, NamedTypes);
-  return sty;
+  return SFunctionType::get(args, ret);
 }
 void SFunctionType::MatchGenerics(
     const vector<SType*> &callTypes,
@@ -147,7 +166,8 @@ void SFunctionType::MatchGenerics(
   assert(genericBindings.size() == 0);
   map<SGenericType*, SType*> matchedGenerics;
   for (unsigned i=0, e=Args.size(); i != e; ++i) {
-    if (SGenericType* gen = dynamic_cast<SGenericType*>(Args[i])) {
+    SGenericType* gen = dynamic_cast<SGenericType*>(Args[i]);
+    if (gen != NULL && matchedGenerics.count(gen) == 0) {
       matchedGenerics[gen] = callTypes[i];
       genericBindings.push_back(callTypes[i]);
     }
@@ -191,6 +211,13 @@ SGenericType *TypePlaceholder::ResolveAsGeneric(map<string,SType*> &NamedTypes)
 /////////////////////////////////////////////////////////////////////
 
 
+bool SStructType::hasPointerFields() {
+  for (unsigned i=0, e=ElementSTypes.size(); i != e; ++i)
+    if (ElementSTypes[i]->containsPointers())
+      return true;
+  return false;
+}
+
 unsigned SStructType::getIndex(const string &name) {
   for (unsigned i=0, e =ElementNames.size(); i != e; ++i)
     if (ElementNames[i] == name)
@@ -201,6 +228,7 @@ unsigned SStructType::getIndex(const string &name) {
 map<string,SType*> SType::BuiltinsMap;
 const map<string,SType*> &SType::Builtins() {
   if (BuiltinsMap.size() == 0) {
+    Arena::Suspend outlivesArena;
     BuiltinsMap["Bool"]  = new SBool();
     BuiltinsMap["Int8"]  = new Int8();
     BuiltinsMap["Int16"] = new Int16();
@@ -213,20 +241,82 @@ const map<string,SType*> &SType::Builtins() {
   return BuiltinsMap;
 }
 
-SString *SString::Singleton = NULL;
-SString* SString::get() {
-  if (Singleton == NULL)
-    Singleton = new SString();
+// The primitives are the builtins of the same name.
+static SType *GetBuiltin(const char *name) {
+  return SType::Builtins().find(name)->second;
+}
+Int8  *Int8 ::get() { return static_cast<Int8 *>(GetBuiltin("Int8")); }
+Int16 *Int16::get() { return static_cast<Int16*>(GetBuiltin("Int16")); }
+Int32 *Int32::get() { return static_cast<Int32*>(GetBuiltin("Int32")); }
+Int64 *Int64::get() { return static_cast<Int64*>(GetBuiltin("Int64")); }
+SBool *SBool::get() { return static_cast<SBool*>(GetBuiltin("Bool")); }
+
+SVoid *SVoid::get() {
+  static SVoid *Singleton = NULL;
+  if (Singleton == NULL) {
+    Arena::Suspend outlivesArena;
+    Singleton = new SVoid();
+  }
   return Singleton;
 }
 
+namespace {
+  // Uniqued composite types. They refer to the types of the program being
+  // compiled, so the table lives and dies with the compilation's arena.
+  class TypeTable : public ArenaObject {
+    static TypeTable *Current;
+  public:
+    map<SType*, SArray*> Arrays;
+    map<pair<vector<SType*>, SType*>, SFunctionType*> Functions;
+    ~TypeTable() {
+      if (Current == this)
+        Current = NULL;
+    }
+    static TypeTable &get() {
+      if (Current == NULL)
+        Current = new TypeTable();
+      return *Current;
+    }
+  };
+  TypeTable *TypeTable::Current = NULL;
+}
+
+SArray *SArray::get(SType *ty) {
+  SArray *&sty = TypeTable::get().Arrays[ty];
+  if (sty == NULL) {
+    sty = new SArray(ty);
+    vector<string> x1;
+    map<string, SType*> x2;
+    sty->Bind(x1, x2);
+  }
+  return sty;
+}
+
+SFunctionType *SFunctionType::get(const vector<SType*> &args, SType *ret) {
+  SFunctionType *&sty =
+    TypeTable::get().Functions[pair<vector<SType*>, SType*>(args, ret)];
+  if (sty == NULL) {
+    // The name is structural, it shows up in specialized function names.
+    string name("Function[");
+    for (unsigned i=0, e=args.size(); i != e; ++i)
+      name += (args[i] ? args[i]->getName() : string("?")) + ",";
+    name += ret->getName() + "]";
+    sty = new SFunctionType(name, args, ret);
+  }
+  return sty;
+}
+
+SString* SString::get() {
+  return static_cast<SString*>(GetBuiltin("String"));
+}
+
 Type *SArray::GenericTypeSingleton = NULL;
 Type* SArray::GenericType() {
   if (GenericTypeSingleton == NULL) {
     const Type *i8 = Type::getInt8PtrTy(getGlobalContext());
     vector<const Type *> tys;
     tys.push_back(Type::getInt32Ty(getGlobalContext()));
-    tys.push_back(PointerType::getUnqual(ArrayType::get(i8, 0)));
+    tys.push_back(ArrayType::get(i8, 0));
     GenericTypeSingleton = PointerType::getUnqual(
       StructType::get(getGlobalContext(), tys));
   }
@@ -1,19 +1,25 @@
+#define DEBUG_TYPE "spl"
 #include "ast.h"
-#include <list>
+#include "llvm/ADT/Statistic.h"
+#include <algorithm>
 #include <iostream>
 
+STATISTIC(NumEquations, "Type equations unified");
+STATISTIC(NumUnions, "Type classes merged");
+STATISTIC(NumDeferred, "Member and array accesses typed late");
+
 namespace SPL { namespace AST {
 
 extern map<string,SType*> NamedTypes; // TODO: hackish nonsense
 
 void Number::TypeInfer(TypeInferer &inferer) {
-  inferer.ty(this, new Int32());
+  inferer.ty(this, Int32::get());
 }
 void StringLiteral::TypeInfer(TypeInferer &inferer) {
-  inferer.ty(this, new SString());
+  inferer.ty(this, SString::get());
 }
 void JoinString::TypeInfer(TypeInferer &inferer) {
-  inferer.ty(this, new SString());
+  inferer.ty(this, SString::get());
   LHS->TypeInfer(inferer);
   RHS->TypeInfer(inferer);
 }
@@ -31,7 +37,7 @@ void BinaryOp::TypeInfer(TypeInferer &inferer) {
   RHS->TypeInfer(inferer);
 }
 void Eq::TypeInfer(TypeInferer &inferer) {
-  inferer.ty(this, new SBool());
+  inferer.ty(this, SBool::get());
   LHS->TypeInfer(inferer);
   RHS->TypeInfer(inferer);
 }
@@ -68,6 +74,8 @@ void Member::TypeInferSecondPass() {
       << "' on `" << sty->getName() << "'" << std::endl;
     exit(1);
   }
+  if (Assigned)
+    sty->setMutated();
   setSType(sty->getSType(fieldIndex));
 }
 void Binding::TypeInfer(TypeInferer &inferer) {
@@ -80,14 +88,55 @@ void If::TypeInfer(TypeInferer &inferer) {
   Cond->TypeInfer(inferer);
   Then->TypeInfer(inferer);
   Else->TypeInfer(inferer);
-  inferer.ty(Cond, new SBool());
+  inferer.ty(Cond, SBool::get());
   inferer.eqn(this,Then);
   inferer.eqn(this,Else);
 }
 void While::TypeInfer(TypeInferer &inferer) {
   Cond->TypeInfer(inferer);
   Body->TypeInfer(inferer);
-  inferer.ty(this, new SVoid());
+  inferer.ty(this, SVoid::get());
+}
+void For::TypeInfer(TypeInferer &inferer) {
+  if (Over == NULL) {
+    From->TypeInfer(inferer);
+    Until->TypeInfer(inferer);
+    inferer.ty(From, Int32::get());
+    inferer.ty(Until, Int32::get());
+    inferer.ty(Var, Int32::get());
+  } else {
+    // Infers Over, as the source of the access.
+    Element->TypeInfer(inferer);
+    inferer.eqn(Var, Element);
+  }
+  Body->TypeInfer(inferer);
+  inferer.ty(this, SVoid::get());
+}
+// A type variable, or an array of them: types are uniqued, so either
+// is the same SType wherever it appears in a signature.
+static bool isGenericSType(SType *ty) {
+  if (SArray *arr = dynamic_cast<SArray*>(ty))
+    return arr->getContained() != NULL && isGenericSType(arr->getContained());
+  return dynamic_cast<SGenericType*>(ty) != NULL;
+}
+// The signature of a function passed by name, through an immutable
+// binding, or as a closure, when it is known before inference.
+static SFunctionType *getFuncArgSType(Expr *arg) {
+  for (;;) {
+    if (Variable *var = dynamic_cast<Variable*>(arg))
+      arg = var->getBinding();
+    else if (Register *reg = dynamic_cast<Register*>(arg))
+      arg = reg->isMutable() ? NULL : reg->getSource();
+    else
+      break;
+    if (arg == NULL)
+      return NULL;
+  }
+  if (Closure *cl = dynamic_cast<Closure*>(arg))
+    return cl->getFunc()->getFunctionSType();
+  if (Func *fn = dynamic_cast<Func*>(arg))
+    return fn->getFunctionSType();
+  return dynamic_cast<SFunctionType*>(arg->getSType());
 }
 void Call::TypeInfer(TypeInferer &inferer) {
   SFunctionType *funTy;
@@ -108,14 +157,32 @@ void Call::TypeInfer(TypeInferer &inferer) {
     Args[i]->TypeInfer(inferer);
 
   SType *retTy = funTy->getReturnType();
-  if (SGenericType *ret = dynamic_cast<SGenericType*>(retTy)) {
+  if (isGenericSType(retTy)) {
     // Match the return type to one of the input types to the generic.
     vector<SType*> argTys = funTy->getArgs();
-    for (unsigned i=0, e=argTys.size(); i != e; ++i) {
-      if (argTys[i] == ret) {
-        inferer.eqn(this, Args[i]);
-        break;
-      }
+    unsigned i = 0, e = argTys.size();
+    while (i != e && argTys[i] != retTy)
+      ++i;
+    if (i != e) {
+      inferer.eqn(this, Args[i]);
+      return;
+    }
+    // Or to what a function passed in returns, as for parMap, whose
+    // Array[B] is made of what its A -> B returns.
+    SType *elTy = retTy;
+    SArray *arr = dynamic_cast<SArray*>(retTy);
+    if (arr != NULL)
+      elTy = arr->getContained();
+    for (i=0; i != e; ++i) {
+      SFunctionType *paramTy = dynamic_cast<SFunctionType*>(argTys[i]);
+      if (paramTy == NULL || paramTy->getReturnType() != elTy)
+        continue;
+      SFunctionType *argTy = getFuncArgSType(Args[i]);
+      if (argTy == NULL || isGenericSType(argTy->getReturnType()))
+        continue;
+      SType *ty = argTy->getReturnType();
+      inferer.ty(this, arr != NULL ? SArray::get(ty) : ty);
+      break;
     }
   } else {
     // Match this type to the concrete return type.
@@ -129,9 +196,32 @@ void RegisterFunArg::TypeInfer(TypeInferer &inferer) {
   inferer.ty(this, ThisType); // Set in the Bind phase by func type signature.
 }
 void Func::TypeInfer(TypeInferer &inferer) {
+  // Captured arguments have been typed by the enclosing function, which is
+  // inferred first.
+  bool captured = false;
+  for (unsigned i=0, e=ArgSTypes.size(); i != e; ++i) {
+    if (ArgSTypes[i] != NULL)
+      continue;
+    ArgSTypes[i] = ArgRegs[i]->getSType();
+    if (ArgSTypes[i] == NULL) {
+      std::cerr << "Unable to infer type of captured `" << Args[i]
+        << "' in function `" << Name << "'." << std::endl;
+      exit(1);
+    }
+    captured = true;
+  }
+  if (captured && RetSType != NULL)
+    setSType(SFunctionType::get(ArgSTypes, RetSType));
+
   inferer.ty(Body, RetSType);
   Body->TypeInfer(inferer);
 }
+void Func::inferReturnType() {
+  if (RetSTypeName != NULL)
+    return;
+  RetSType = Body->getSType();
+  setSType(SFunctionType::get(ArgSTypes, RetSType));
+}
 void Closure::TypeInfer(TypeInferer &inferer) {
   SFunctionType *ft = FuncRef->getFunctionSType();
   vector <SType*> funArgs = ft->getArgs();
@@ -140,13 +230,12 @@ void Closure::TypeInfer(TypeInferer &inferer) {
   for (unsigned i=ActivationRecord.size(), e=funArgs.size(); i != e; ++i)
     closureArgs.push_back(funArgs[i]);
 
-  string Name("$SomeClosure$");
-  inferer.ty(this, new SFunctionType(Name, closureArgs, ft->getReturnType()));
+  inferer.ty(this, SFunctionType::get(closureArgs, ft->getReturnType()));
 
   vector<RegisterFunArg*> argRegs;
   FuncRef->getArgRegs(argRegs);
   for (unsigned i=0, e=ActivationRecord.size(); i != e; ++i)
-    inferer.eqn(ActivationRecord[i], argRegs[i]);
+    inferer.eqn(argRegs[i], ActivationRecord[i]);
 }
 void Array::TypeInfer(TypeInferer &inferer) {
   SizeExpr->TypeInfer(inferer);
@@ -157,11 +246,7 @@ void Array::TypeInfer(TypeInferer &inferer) {
     std::cerr << "Unknown type for Array: " << STypeName << std::endl;
     exit(1);
   }
-  SArray *sty = new SArray(ty);
-  vector<string> x1;
-  map<string, SType*> x2;
-  sty->Bind(x1, x2);
-  inferer.ty(this, sty);
+  inferer.ty(this, SArray::get(ty));
 }
 void Constructor::TypeInfer(TypeInferer &inferer) {
   inferer.ty(this, ThisType);
@@ -174,119 +259,148 @@ void Constructor::TypeInfer(TypeInferer &inferer) {
 }
 
 
-unsigned TypeInferer::ResolveMembers() {
-  vector<Member*> remainingMembers;
-  for (unsigned i=0, e=members.size(); i != e; ++i) {
-    Expr *src = members[i]->getSource();
-    if (tys.count(src) > 0) {
-      src->setSType(tys[src]);
-      members[i]->TypeInferSecondPass();
-      tys[members[i]] = members[i]->getSType();
-    } else {
-      remainingMembers.push_back(members[i]);
-    }
-  }
+static const unsigned NoWaiter = ~0u;
+static unsigned NextEpoch = 1;
+
+TypeInferer::TypeInferer(): Epoch(NextEpoch++) {}
 
-  unsigned membersResolved = members.size() - remainingMembers.size();
-  if (membersResolved > 0)
-    members.assign(remainingMembers.begin(), remainingMembers.end());
-  return membersResolved;
+unsigned TypeInferer::id(Expr *e) {
+  if (e->InferEpoch != Epoch) {
+    e->InferEpoch = Epoch;
+    e->InferId = nodes.size();
+    nodes.push_back(e);
+    tys.push_back(NULL);
+    parent.push_back(e->InferId);
+    rank.push_back(0);
+    classTys.push_back(NULL);
+    waiterHead.push_back(NoWaiter);
+  }
+  return e->InferId;
 }
 
-unsigned TypeInferer::ResolveArrayAccesses() {
-  vector<ArrayAccess*> remaining;
-  for (unsigned i=0, e=arrayAccesses.size(); i != e; ++i) {
-    Expr *src = arrayAccesses[i]->getSource();
-    if (tys.count(src) > 0) {
-      src->setSType(tys[src]);
-      arrayAccesses[i]->TypeInferSecondPass();
-      tys[arrayAccesses[i]] = arrayAccesses[i]->getSType();
-    } else {
-      remaining.push_back(arrayAccesses[i]);
-    }
+unsigned TypeInferer::find(unsigned n) {
+  unsigned root = n;
+  while (parent[root] != root)
+    root = parent[root];
+  while (parent[n] != root) {
+    unsigned next = parent[n];
+    parent[n] = root;
+    n = next;
   }
+  return root;
+}
 
-  unsigned resolved = arrayAccesses.size() - remaining.size();
-  if (resolved > 0)
-    arrayAccesses.assign(remaining.begin(), remaining.end());
-  return resolved;
+void TypeInferer::unite(unsigned a, unsigned b) {
+  a = find(a);
+  b = find(b);
+  if (a == b)
+    return;
+  ++NumUnions;
+  if (rank[a] < rank[b])
+    std::swap(a, b);
+  parent[b] = a;
+  if (rank[a] == rank[b])
+    rank[a]++;
 }
 
-void TypeInferer::TypeUnification() {
-  std::list<pair<Expr*,Expr*> > es;
-  {
-    multimap<Expr*,Expr*>::const_iterator i;
-    for (i=eqns.begin(); i != eqns.end(); i++) {
-      es.push_back(*i);
+// Types a class the first time, and queues the constraints waiting on it.
+void TypeInferer::setClassType(
+    unsigned root, SType *ty, vector<unsigned> &ready) {
+  if (classTys[root] != NULL)
+    return;
+  classTys[root] = ty;
+  ready.push_back(root);
+}
 
-      Expr *fst = i->first;
-      if (fst->getSType() != NULL && tys.count(fst) == 0)
-        tys[fst] = fst->getSType();
+// An expression's own type takes precedence over that of its class.
+SType *TypeInferer::lookup(unsigned n) {
+  return tys[n] != NULL ? tys[n] : classTys[find(n)];
+}
 
-      Expr *snd = i->second;
-      if (snd->getSType() != NULL && tys.count(snd) == 0)
-        tys[snd] = snd->getSType();
-    }
+void TypeInferer::TypeUnification() {
+  NumEquations += eqns.size();
+  for (unsigned i=0, e=eqns.size(); i != e; ++i) {
+    unsigned fst = eqns[i].first, snd = eqns[i].second;
+    if (tys[fst] == NULL && nodes[fst]->getSType() != NULL)
+      ty(nodes[fst], nodes[fst]->getSType());
+    if (tys[snd] == NULL && nodes[snd]->getSType() != NULL)
+      ty(nodes[snd], nodes[snd]->getSType());
+    unite(fst, snd);
+  }
+
+  for (unsigned i=0, e=deferred.size(); i != e; ++i) {
+    Expr *src = dynamic_cast<Member*>(deferred[i])
+      ? static_cast<Member*>(deferred[i])->getSource()
+      : static_cast<ArrayAccess*>(deferred[i])->getSource();
+    unsigned root = find(id(src));
+    waiterNext.push_back(waiterHead[root]);
+    waiterHead[root] = i;
   }
 
-  unsigned noMatchesIn = 0;
-  while (es.size() > 0) {
-    pair<Expr*,Expr*> eqn = es.front();
-    es.pop_front();
+  vector<unsigned> ready;
+  for (unsigned i=0, e=tyOrder.size(); i != e; ++i)
+    setClassType(find(tyOrder[i]), tys[tyOrder[i]], ready);
 
-    /*
-    if (tys.count(eqn.first) > 0) {
-      tys[eqn.second] = tys[eqn.first];
-      noMatchesIn = 0;
-    } else*/ if (tys.count(eqn.second) > 0) {
-      if (tys.count(eqn.first) == 0)
-        tys[eqn.first] = tys[eqn.second];
-      noMatchesIn = 0;
-    } else {
-      es.push_back(eqn);
-      noMatchesIn++;
-    }
+  // Each class is typed once, so every deferred constraint is woken once.
+  unsigned resolved = 0;
+  while (!ready.empty()) {
+    unsigned root = ready.back();
+    ready.pop_back();
 
-    if (noMatchesIn > es.size() + 2) {
-      // Try resolving member accesses to give us more type fodder.
-      if (ResolveMembers() == 0 && ResolveArrayAccesses() == 0) {
-        // Could not resolve any members. Now we are in trouble.
-        break;
+    for (unsigned w=waiterHead[root]; w != NoWaiter; w=waiterNext[w]) {
+      Expr *d = deferred[w];
+      if (Member *m = dynamic_cast<Member*>(d)) {
+        m->getSource()->setSType(lookup(id(m->getSource())));
+        m->TypeInferSecondPass();
       } else {
-        noMatchesIn = 0;
+        ArrayAccess *a = static_cast<ArrayAccess*>(d);
+        a->getSource()->setSType(lookup(id(a->getSource())));
+        a->TypeInferSecondPass();
       }
+      unsigned n = id(d);
+      tys[n] = d->getSType();
+      setClassType(find(n), tys[n], ready);
+      resolved++;
+      ++NumDeferred;
     }
+    waiterHead[root] = NoWaiter;
   }
 
-  while (ResolveMembers() > 0 || ResolveArrayAccesses() > 0) {
-    ;
-  }
-
-  if (es.size() > 0) {
-    std::vector<pair<Expr*,Expr*> > eqnsV(es.begin(), es.end()); // XXX for gdb
-    std::cerr << "Unable to resolve all types." << std::endl;
-    exit(1);
-  } else if (members.size() > 0) {
-    std::cerr << "Unable to resolve all type members." << std::endl;
-    exit(1);
-  } else if (arrayAccesses.size() > 0) {
+  if (resolved != deferred.size()) {
+    for (unsigned i=0, e=deferred.size(); i != e; ++i) {
+      if (dynamic_cast<Member*>(deferred[i]) && tys[id(deferred[i])] == NULL) {
+        std::cerr << "Unable to resolve all type members." << std::endl;
+        exit(1);
+      }
+    }
     std::cerr << "Unable to resolve all array access types." << std::endl;
     exit(1);
   }
+  for (unsigned i=0, e=nodes.size(); i != e; ++i) {
+    if (lookup(i) == NULL) {
+      std::cerr << "Unable to resolve all types." << std::endl;
+      exit(1);
+    }
+  }
 }
 
 void TypeInferer::TypePopulation() {
-  for (map<Expr*,SType*>::const_iterator i=tys.begin(); i!=tys.end(); i++)
-    i->first->setSType(i->second);
+  for (unsigned i=0, e=nodes.size(); i != e; ++i)
+    nodes[i]->setSType(lookup(i));
 }
 
 void TypeInferer::eqn(Expr* lhs, Expr* rhs) {
-  eqns.insert(pair<Expr*, Expr*>(lhs, rhs));
+  unsigned l = id(lhs);
+  eqns.push_back(pair<unsigned, unsigned>(l, id(rhs)));
 }
 void TypeInferer::ty(Expr* expr, SType* ty) {
-  tys.insert(pair<Expr*, SType*>(expr, ty));
+  unsigned n = id(expr);
+  if (tys[n] == NULL && ty != NULL) {
+    tys[n] = ty;
+    tyOrder.push_back(n);
+  }
 }
-void TypeInferer::member(Member *m) { members.push_back(m); }
-void TypeInferer::arrayAccess(ArrayAccess *a) { arrayAccesses.push_back(a); }
+void TypeInferer::member(Member *m) { deferred.push_back(m); }
+void TypeInferer::arrayAccess(ArrayAccess *a) { deferred.push_back(a); }
 
 }};
@@ -1,34 +1,377 @@
+#include "native.h"
+#include "pipeline.h"
+#include <cstdio>
 #include <string>
 #include <iostream>
+#include "llvm/Constants.h"
+#include "llvm/Instructions.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
+#include "llvm/Analysis/Dominators.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/IRBuilder.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/System/Host.h"
+#include "llvm/System/TimeValue.h"
 #include "llvm/Target/TargetSelect.h"
 #include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetOptions.h"
 #include "llvm/PassManager.h"
 
+#include <algorithm>
 #include <dlfcn.h>
+#include <sys/resource.h>
+#include <vector>
 
 using namespace llvm;
 
 cl::list<std::string> InputFilenames(
   cl::Positional, cl::desc("<program>"), cl::OneOrMore);
-cl::opt<bool> Optimize("O", cl::desc("Optimize"));
+cl::opt<char> OptLevel(
+  "O", cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default -O0)"),
+  cl::Prefix, cl::ZeroOrMore, cl::init('0'));
+cl::opt<std::string> CacheDir(
+  "cache-dir", cl::desc("Keep the machine code of programs in this directory"),
+  cl::value_desc("dir"));
+cl::opt<bool> TieredMode(
+  "tiered", cl::desc("Compile without optimization, reoptimize hot functions"));
+cl::opt<unsigned> TierThreshold(
+  "tier-threshold",
+  cl::desc("Calls plus loop iterations that make a function hot"),
+  cl::init(1000));
+cl::opt<bool> TierStats(
+  "tier-stats", cl::desc("Report functions as they are reoptimized"));
+cl::opt<bool> TimeRun(
+  "time", cl::desc("Report optimization, JIT and run time and peak memory"));
+
+// The runtime: prelude.ll, runtime.cpp and the tiering hook below.
+extern "C" int32_t print(void *);
+extern "C" int32_t printChar(int32_t);
+extern "C" int32_t printAll(void *);
+extern "C" int32_t flush();
+extern "C" int32_t length(void *);
+extern "C" void *spl_alloc_profiled(int64_t, int32_t, const char *);
+extern "C" int32_t spl_par_chunks(int32_t);
+extern "C" void spl_par_run(int32_t, int32_t, void *, void *);
+extern "C" void spl_tier_up(int32_t idx);
+
+static const struct {
+  const char *Name;
+  void *Address;
+} VMFuncs[] = {
+  { "print", (void*)(intptr_t)print },
+  { "printChar", (void*)(intptr_t)printChar },
+  { "printAll", (void*)(intptr_t)printAll },
+  { "flush", (void*)(intptr_t)flush },
+  { "length", (void*)(intptr_t)length },
+  { "spl_alloc_profiled", (void*)(intptr_t)spl_alloc_profiled },
+  { "spl_par_chunks", (void*)(intptr_t)spl_par_chunks },
+  { "spl_par_run", (void*)(intptr_t)spl_par_run },
+  { "spl_tier_up", (void*)(intptr_t)spl_tier_up },
+};
 
-extern "C" void *print;
-extern "C" void *length;
 void *FindVMFunc(const std::string &name) {
-  if (name == "print")
-    return print;
-  else if (name == "length")
-    return length;
-  else
+  for (unsigned i=0, e=sizeof(VMFuncs)/sizeof(VMFuncs[0]); i != e; ++i)
+    if (name == VMFuncs[i].Name)
+      return VMFuncs[i].Address;
+  return NULL;
+}
+
+static double secondsSince(const sys::TimeValue &start) {
+  sys::TimeValue elapsed = sys::TimeValue::now() - start;
+  return elapsed.seconds() + elapsed.nanoseconds() / 1e9;
+}
+
+// Tiered compilation. Every function first runs unoptimized, counting
+// its calls and loop iterations: a probe at its entry and at every loop
+// header, a block that dominates a predecessor. When the count reaches
+// the threshold the counting is taken out again, the function pipeline
+// is run over the function and the JIT recompiles it, redirecting the
+// old code to the new.
+//
+// The call that got hot switches to the new code by calling it, where
+// it is in the same state as on entry: at the entry itself, with its
+// arguments, and at the head of the loop SPL loops by, self tail calls,
+// with the arguments they stored back (see Func::Gen). A hot counted or
+// while loop carries on in the old code until its call returns.
+namespace {
+
+// Counting code at the head of one block: `Head' counts and branches
+// to `Rest', the original block, or through `TierUp' when hot.
+struct Probe {
+  BasicBlock *Head, *TierUp, *Rest;
+};
+
+struct TieredFunction {
+  Function *F;
+  std::vector<Probe> Probes;
+  bool Hot;
+};
+
+std::vector<TieredFunction> TieredFunctions;
+ExecutionEngine *Engine;
+FunctionPassManager *HotPasses;
+
+BasicBlock::iterator getProbePoint(BasicBlock *bb) {
+  // Allocas stay in the entry block for mem2reg to find when hot.
+  BasicBlock::iterator it = bb->begin();
+  while (isa<PHINode>(it) || isa<AllocaInst>(it))
+    ++it;
+  return it;
+}
+
+// With reentry, the tier up calls the function with those arguments,
+// loading the allocas among them, and returns what it does.
+void addProbe(TieredFunction &tf, BasicBlock *bb, Constant *counter,
+    Function *tierUp, unsigned idx, const std::vector<Value*> *reentry) {
+  Probe probe;
+  probe.Head = bb;
+  probe.Rest = bb->splitBasicBlock(getProbePoint(bb), bb->getName() + ".body");
+  probe.TierUp = BasicBlock::Create(
+    bb->getContext(), "tierup", bb->getParent(), probe.Rest);
+  bb->getTerminator()->eraseFromParent();
+
+  IRBuilder<> b(bb);
+  Value *n = b.CreateAdd(b.CreateLoad(counter), b.getInt32(1));
+  b.CreateStore(n, counter);
+  b.CreateCondBr(
+    b.CreateICmpEQ(n, b.getInt32(TierThreshold)), probe.TierUp, probe.Rest);
+  b.SetInsertPoint(probe.TierUp);
+  b.CreateCall(tierUp, b.getInt32(idx));
+  if (reentry == NULL) {
+    b.CreateBr(probe.Rest);
+  } else {
+    std::vector<Value*> args;
+    for (unsigned i=0, e=reentry->size(); i != e; ++i) {
+      Value *arg = (*reentry)[i];
+      args.push_back(isa<AllocaInst>(arg) ? b.CreateLoad(arg) : arg);
+    }
+    Function *f = bb->getParent();
+    CallInst *call = b.CreateCall(f, args.begin(), args.end());
+    call->setCallingConv(f->getCallingConv());
+    call->setTailCall();
+    if (f->getReturnType()->isVoidTy())
+      b.CreateRetVoid();
+    else
+      b.CreateRet(call);
+  }
+
+  tf.Probes.push_back(probe);
+}
+
+// The block self tail calls branch back to, as Func::Gen lays it out:
+// the entry stores each argument to an alloca and branches to it, and
+// the loop keeps all its state in memory. Optimized code does not look
+// like this, and has no such block.
+BasicBlock *findRecurseBlock(Function *f, std::vector<Value*> &argAllocas) {
+  BasicBlock *entry = &f->getEntryBlock();
+  BranchInst *br = dyn_cast<BranchInst>(entry->getTerminator());
+  if (br == NULL || !br->isUnconditional() ||
+      isa<PHINode>(br->getSuccessor(0)->front()))
     return NULL;
+  for (Function::arg_iterator ai = f->arg_begin(); ai != f->arg_end(); ++ai) {
+    Value *alloca = NULL;
+    for (BasicBlock::iterator it = entry->begin(); it != entry->end(); ++it)
+      if (StoreInst *st = dyn_cast<StoreInst>(it))
+        if (st->getOperand(0) == &*ai && isa<AllocaInst>(st->getOperand(1)))
+          alloca = st->getOperand(1);
+    if (alloca == NULL)
+      return NULL;
+    argAllocas.push_back(alloca);
+  }
+  return br->getSuccessor(0);
+}
+
+void removeProbe(Probe &probe) {
+  BasicBlock *bb = probe.Head;
+  while (!bb->empty() && !isa<PHINode>(bb->back()) &&
+      !isa<AllocaInst>(bb->back()))
+    bb->back().eraseFromParent();
+  probe.TierUp->eraseFromParent();
+  BranchInst::Create(probe.Rest, bb);
+}
+
+void addProbes(Module *module) {
+  LLVMContext &ctx = module->getContext();
+  std::vector<Function*> fns;
+  for (Module::iterator it = module->begin(); it != module->end(); ++it)
+    if (!it->isDeclaration())
+      fns.push_back(&*it);
+
+  const Type *i32 = Type::getInt32Ty(ctx);
+  const ArrayType *countersTy = ArrayType::get(i32, fns.size());
+  GlobalVariable *counters = new GlobalVariable(
+    *module, countersTy, false, GlobalValue::InternalLinkage,
+    Constant::getNullValue(countersTy), "spl.tier.counters");
+  Function *tierUp = Function::Create(
+    FunctionType::get(Type::getVoidTy(ctx), std::vector<const Type*>(1, i32),
+      false),
+    Function::ExternalLinkage, "spl_tier_up", module);
+
+  for (unsigned i=0, e=fns.size(); i != e; ++i) {
+    TieredFunction tf;
+    tf.F = fns[i];
+    tf.Hot = false;
+
+    BasicBlock *entry = &tf.F->getEntryBlock();
+    DominatorTreeBase<BasicBlock> dt(false);
+    dt.recalculate(*tf.F);
+    std::vector<BasicBlock*> heads(1, entry);
+    for (Function::iterator bb = tf.F->begin(); bb != tf.F->end(); ++bb) {
+      TerminatorInst *term = bb->getTerminator();
+      for (unsigned s=0, se=term->getNumSuccessors(); s != se; ++s) {
+        BasicBlock *succ = term->getSuccessor(s);
+        if (dt.dominates(succ, &*bb) &&
+            std::find(heads.begin(), heads.end(), succ) == heads.end())
+          heads.push_back(succ);
+      }
+    }
+
+    std::vector<Value*> args, argAllocas;
+    for (Function::arg_iterator ai = tf.F->arg_begin(); ai != tf.F->arg_end();
+        ++ai)
+      args.push_back(&*ai);
+    BasicBlock *recurse = findRecurseBlock(tf.F, argAllocas);
+
+    Constant *indices[] = { ConstantInt::get(i32, 0), ConstantInt::get(i32, i) };
+    Constant *counter = ConstantExpr::getGetElementPtr(counters, indices, 2);
+    for (unsigned h=0, he=heads.size(); h != he; ++h)
+      addProbe(tf, heads[h], counter, tierUp, i,
+        h == 0 ? &args : heads[h] == recurse ? &argAllocas : NULL);
+    TieredFunctions.push_back(tf);
+  }
+}
+
+} // end anonymous namespace
+
+extern "C" void spl_tier_up(int32_t idx) {
+  TieredFunction &tf = TieredFunctions[idx];
+  if (tf.Hot)
+    return;
+  tf.Hot = true;
+
+  sys::TimeValue start = sys::TimeValue::now();
+  for (unsigned i=0, e=tf.Probes.size(); i != e; ++i)
+    removeProbe(tf.Probes[i]);
+  tf.Probes.clear();
+  HotPasses->run(*tf.F);
+  Engine->recompileAndRelinkFunction(tf.F);
+
+  if (TierStats)
+    std::cerr << "Tier up: " << tf.F->getName().str() << " ("
+              << secondsSince(start) * 1e3 << " ms)" << std::endl;
+}
+
+typedef int32_t (*MainFn)();
+
+// Runs the program's main, printing its result. With -time, the time
+// taken to get it ready and to run it are reported on stderr, one
+// `<metric> <value>' per line, for bench/run.sh.
+static void runMain(MainFn fp, double optSeconds, double jitSeconds) {
+  sys::TimeValue start = sys::TimeValue::now();
+  int32_t res = fp();
+  // The program's output comes before the result, and counts as running.
+  flush();
+  double runSeconds = secondsSince(start);
+  std::cout << "Result: " << res << std::endl;
+
+  if (TimeRun) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cerr << "opt-seconds " << optSeconds << "\n"
+              << "jit-seconds " << jitSeconds << "\n"
+              << "run-seconds " << runSeconds << "\n"
+              << "peak-rss-kb " << usage.ru_maxrss << std::endl;
+  }
+}
+
+// Runs the standard pipeline over the program before it is compiled.
+// With the engine's TargetData the passes know the host's layout.
+static void optimizeModule(
+    Module *module, unsigned level, const TargetData *td) {
+  FunctionPassManager fpm(module);
+  if (td != NULL)
+    fpm.add(new TargetData(*td));
+  SPL::addStandardFunctionPasses(fpm, level);
+  fpm.doInitialization();
+  iplist<Function> &fns = module->getFunctionList();
+  for (iplist<Function>::iterator it = fns.begin(); it != fns.end(); it++)
+    fpm.run(*it);
+  fpm.doFinalization();
+
+  PassManager pm;
+  if (td != NULL)
+    pm.add(new TargetData(*td));
+  SPL::addStandardModulePasses(pm, level);
+  pm.run(*module);
+}
+
+// FNV-1a, 64 bit.
+static uint64_t hashBytes(StringRef s, uint64_t h = 14695981039346656037ULL) {
+  for (unsigned i=0, e=s.size(); i != e; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// The JIT cannot save what it generates, so the code cache holds each
+// program as a shared library, keyed by its bitcode and the machine it
+// was compiled for. A miss compiles the library once, later runs only
+// map it. Libraries resolve the runtime (print, length, GC_malloc)
+// against this executable, which exports it with -rdynamic.
+static MainFn loadCachedProgram(
+    Module *module, MemoryBuffer *bitcode, unsigned level) {
+  std::string triple = sys::getHostTriple(), cpu = sys::getHostCPUName();
+  uint64_t h = hashBytes(bitcode->getBuffer());
+  h = hashBytes(triple, h);
+  h = hashBytes(cpu, h);
+  h = hashBytes(StringRef(&OptLevel.getValue(), 1), h);
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+  std::string path = CacheDir + "/" + key + ".so";
+
+  sys::TimeValue start = sys::TimeValue::now();
+  void *lib = dlopen(path.c_str(), RTLD_NOW);
+  bool hit = lib != NULL;
+  if (!hit) {
+    std::string err, asmFile = path + ".s", tmp = path + ".tmp";
+    if (level > 0)
+      optimizeModule(module, level, NULL);
+    if (!SPL::writeNativeAssembly(*module, asmFile, err, true)) {
+      std::cerr << "Unable to generate native code: " << err << std::endl;
+      exit(1);
+    }
+    // -Bsymbolic: the program's own main must not bind to the VM's.
+    std::vector<std::string> args;
+    args.push_back("-shared");
+    args.push_back("-Wl,-Bsymbolic");
+    args.push_back(asmFile);
+    args.push_back("-o");
+    args.push_back(tmp);
+    bool built = SPL::runSystemCompiler(args, err);
+    std::remove(asmFile.c_str());
+    if (!built || std::rename(tmp.c_str(), path.c_str())) {
+      std::cerr << "Unable to write cache file: " << path << ": " << err
+                << std::endl;
+      exit(1);
+    }
+    lib = dlopen(path.c_str(), RTLD_NOW);
+  }
+  void *fptr = lib == NULL ? NULL : dlsym(lib, "main");
+  if (fptr == NULL) {
+    std::cerr << "Unable to load cached program: " << path << ": "
+              << dlerror() << std::endl;
+    exit(1);
+  }
+
+  std::cerr << "Code cache " << (hit ? "hit" : "miss") << ": " << path
+            << " (" << secondsSince(start) * 1e3 << " ms)" << std::endl;
+  return (MainFn)(intptr_t)fptr;
 }
 
 int main(int argc, char** argv) {
@@ -49,8 +392,44 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
+  unsigned level = SPL::getOptLevel(OptLevel);
+
+  if (!CacheDir.empty()) {
+    if (module->getFunction("main") == NULL) {
+      std::cout << "main is not defined!" << std::endl;
+      exit(1);
+    }
+    sys::TimeValue start = sys::TimeValue::now();
+    MainFn fp = loadCachedProgram(module, in, level);
+    runMain(fp, 0, secondsSince(start));
+    return 0;
+  }
+
+  // SPL loops by recursion; fastcc calls marked tail must not grow the stack.
+  GuaranteedTailCallOpt = true;
+
+  // Code run by the parallel loops' worker threads must not call back
+  // into the JIT, to compile lazily or to tier up.
+  bool parallel = module->getFunction("spl_par_run") != NULL;
+  if (parallel && TieredMode) {
+    std::cerr << "-tiered does not support parallel loops, ignoring it"
+              << std::endl;
+    TieredMode = false;
+  }
+
+  if (TieredMode)
+    addProbes(module);
+
   InitializeNativeTarget();
-  ExecutionEngine * engine = EngineBuilder(module).setErrorStr(&err).create();
+  static const CodeGenOpt::Level codeGenLevels[] = {
+    CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default,
+    CodeGenOpt::Aggressive
+  };
+  ExecutionEngine *engine = EngineBuilder(module)
+    .setErrorStr(&err)
+    .setOptLevel(codeGenLevels[level])
+    .setMCPU(sys::getHostCPUName())
+    .create();
   if (!engine) {
     std::cerr << "ExecutionEngine: " << err << std::endl;
     exit(1);
@@ -61,16 +440,22 @@ int main(int argc, char** argv) {
   //std::cerr << "symbolSearching disabled: " << engine->isSymbolSearchingDisabled()
   //  << std::endl;
 
-  if (Optimize) {
-    // TODO: experiment, what exactly does target data optimization give us,
-    //       do we need to run other optimization passes after it?
-    FunctionPassManager fpm(module);
-    fpm.add(new TargetData(*engine->getTargetData()));
-    fpm.doInitialization();
-    iplist<Function> &fns = module->getFunctionList();
-    for (iplist<Function>::iterator it = fns.begin(); it != fns.end(); it++)
-      fpm.run(*it);
-  }
+  // Compile everything up front when timing, so that the run time
+  // does not include lazy compilation, and for the worker threads.
+  if ((TimeRun || parallel) && !TieredMode)
+    engine->DisableLazyCompilation(true);
+
+  sys::TimeValue start = sys::TimeValue::now();
+  if (TieredMode) {
+    // Hot functions get the function pipeline, at -O3 unless told otherwise.
+    Engine = engine;
+    HotPasses = new FunctionPassManager(module);
+    HotPasses->add(new TargetData(*engine->getTargetData()));
+    SPL::addStandardFunctionPasses(*HotPasses, level > 0 ? level : 3);
+    HotPasses->doInitialization();
+  } else if (level > 0)
+    optimizeModule(module, level, engine->getTargetData());
+  double optSeconds = secondsSince(start);
 
   // Execute the function `main'.
   Function *f = module->getFunction("main");
@@ -78,8 +463,8 @@ int main(int argc, char** argv) {
     std::cout << "main is not defined!" << std::endl;
     exit(1);
   }
+  start = sys::TimeValue::now();
   void *fptr = engine->getPointerToFunction(f);
-  int32_t (*fp)() = (int32_t (*)())(intptr_t)fptr;
-  int32_t res = fp();
-  std::cout << "Result: " << res << std::endl;
+  double jitSeconds = secondsSince(start);
+  runMain((MainFn)(intptr_t)fptr, optSeconds, jitSeconds);
 }
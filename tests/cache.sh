@@ -0,0 +1,30 @@
+#!/bin/sh
+# Changing what an array holds in one file must recompile the files that
+# use it: every cached file, the prelude included, gets a new key.
+
+SPLC=${SPLC:-./build/splc}
+SPLVM=${SPLVM:-./build/splvm}
+TMP=${TMPDIR:-/tmp}/spl-cache-test.$$
+mkdir -p $TMP/cache
+trap 'rm -rf $TMP' EXIT
+
+cat > $TMP/b.spl <<SPL
+io main(): Int32 = length(make(3))
+SPL
+
+compile() {
+  cat > $TMP/a.spl <<SPL
+def make(n: Int32): Array[$1] = Array[$1](n, $2)
+SPL
+  $SPLC -cache-dir=$TMP/cache -o $TMP/out.bc $TMP/a.spl $TMP/b.spl &&
+    $SPLVM $TMP/out.bc | grep -qx 'Result: 3' || {
+      echo "FAIL: tests/cache.sh, Array[$1]"; exit 1; }
+  ls $TMP/cache | grep -c '\.bc$'
+}
+
+before=`compile Int32 0` || { echo "$before"; exit 1; }
+after=`compile String '"x"'` || { echo "$after"; exit 1; }
+if [ "$after" -ne `expr 2 \* $before` ]; then
+  echo "FAIL: tests/cache.sh, $before cached files became $after"
+  exit 1
+fi
@@ -0,0 +1,34 @@
+#!/bin/sh
+# The REPL keeps its definitions across inputs, prints Int32 results, and
+# carries on after inputs that it rejects or that fail to compile.
+
+SPLREPL=${SPLREPL:-./build/splrepl}
+TMP=${TMPDIR:-/tmp}/spl-repl-test.$$
+mkdir -p $TMP
+trap 'rm -rf $TMP' EXIT
+
+$SPLREPL > $TMP/out 2> $TMP/err <<SPL
+def sq(x: Int32): Int32 = x * x
+sq(7) + 1
+val y = 3
+def sq(x: Int32): Int32 = x
+nosuch(1)
+{ println("hi"); "done" }
+sq(3)
+:quit
+SPL
+
+printf '50\nhi\n9\n' > $TMP/want
+if ! cmp -s $TMP/want $TMP/out; then
+  cat $TMP/out $TMP/err
+  echo "FAIL: tests/repl.sh, unexpected output"
+  exit 1
+fi
+for err in 'Top-level val and var are not supported' \
+    "\`sq' is already defined" "Cannot find function \`nosuch'"; do
+  if ! grep -qF "$err" $TMP/err; then
+    cat $TMP/err
+    echo "FAIL: tests/repl.sh, expected error: $err"
+    exit 1
+  fi
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# splvm -tiered: functions that cross the threshold by being called, and
+# loops that cross it while running, tier up and carry on in the new code.
+
+SPLC=${SPLC:-./build/splc}
+SPLVM=${SPLVM:-./build/splvm}
+TMP=${TMPDIR:-/tmp}/spl-tiered-test.$$
+mkdir -p $TMP
+trap 'rm -rf $TMP' EXIT
+
+cat > $TMP/loops.spl <<SPL
+def count(n: Int32, acc: Int32): Int32 =
+  if (n == 0) acc else count(n - 1, acc + 2)
+
+def step(x: Int32): Int32 = x + 1
+
+def calls(i: Int32, acc: Int32): Int32 =
+  if (i == 0) acc else calls(i - 1, step(acc))
+
+io main(): Int32 = {
+  var sum = 0;
+  for (i <- 0 until 3000) sum = sum + 1;
+  sum + count(100000, 0) + calls(5000, 0)
+}
+SPL
+
+$SPLC -o $TMP/loops.bc $TMP/loops.spl || exit 1
+$SPLVM -tiered -tier-stats $TMP/loops.bc > $TMP/out 2> $TMP/err
+cat $TMP/out $TMP/err
+grep -qx 'Result: 208000' $TMP/out || {
+  echo "FAIL: tests/tiered.sh, expected Result: 208000"; exit 1; }
+for fn in main count step calls; do
+  grep -q "^Tier up: $fn " $TMP/err || {
+    echo "FAIL: tests/tiered.sh, $fn did not tier up"; exit 1; }
+done